@@ -7,11 +7,24 @@
 // found online at https://opensource.org/licenses/MIT.
 //
 
+#include <algorithm>
+#include <cctype>
 #include <chrono>
+#include <clocale>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <exception>
 #include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <system_error>
 #include <thread>
+#include <unordered_map>
 
 #include "analytics.hpp"
 #include "date.hpp"
@@ -25,7 +38,23 @@
 #include "http-none.hpp"
 #endif
 
+#ifdef SEGMENT_USE_ZLIB
+#include <zlib.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define SEGMENT_USE_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
 #ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 #endif
@@ -35,7 +64,7 @@
 // but having a single file to integrate makes it easier to integrate
 // into other projects.
 
-using json = nlohmann::json;
+using json = segment::analytics::Object;
 
 namespace segment {
 namespace analytics {
@@ -60,14 +89,187 @@ namespace analytics {
         vers = uts.release;
     }
 #endif
-    std::string TimeStamp()
+    // Append a time stamp, as date::format("%FT%TZ") would write it with
+    // millisecond precision.  That is slow (it goes through an ostream),
+    // and events come many to the second; so each thread remembers the
+    // last second it formatted, and usually only the milliseconds are
+    // new.
+    static void appendTimeStamp(std::string& out, std::chrono::system_clock::time_point when)
     {
-        auto now = std::chrono::system_clock::now();
-        auto tmstamp = date::format("%FT%TZ",
-            std::chrono::time_point_cast<std::chrono::milliseconds>(now));
+        static thread_local std::string prefix; // "YYYY-MM-DDTHH:MM:SS"
+        static thread_local date::sys_seconds second;
+
+        auto ms = std::chrono::time_point_cast<std::chrono::milliseconds>(when);
+        auto sec = date::floor<std::chrono::seconds>(ms);
+        if (prefix.empty() || (sec != second)) {
+            prefix = date::format("%FT%T", sec);
+            second = sec;
+        }
+        auto frac = int((ms - sec).count());
+        char suffix[6] = { '.', char('0' + frac / 100), char('0' + frac / 10 % 10), char('0' + frac % 10), 'Z', 0 };
+        out += prefix;
+        out += suffix;
+    }
+
+    std::string TimeStamp(std::chrono::system_clock::time_point when)
+    {
+        std::string tmstamp;
+        tmstamp.reserve(32);
+        appendTimeStamp(tmstamp, when);
         return tmstamp;
     }
 
+    std::string TimeStamp()
+    {
+        return TimeStamp(std::chrono::system_clock::now());
+    }
+
+    // The pools behind PoolAllocator.  Blocks come in size classes, 16
+    // bytes apart.  Each thread keeps a free list for each class, which
+    // needs no lock.  Blocks move between a thread and the common pool
+    // (which does need one) a batch at a time: when the thread runs out,
+    // when it holds more than it is likely to need (as a thread that only
+    // frees what another allocated would), and when it exits.  The common
+    // pool carves new blocks from large chunks of heap.
+    static const size_t poolQuantum = 16;
+    static const size_t poolClasses = 16;
+    static const size_t poolBatch = 64;
+    static const size_t poolChunk = 64 * 1024;
+
+    struct poolBlock {
+        poolBlock* next;
+    };
+
+    struct poolList {
+        poolBlock* head;
+        size_t count;
+
+        void push(poolBlock* b)
+        {
+            b->next = head;
+            head = b;
+            count++;
+        }
+        poolBlock* pop()
+        {
+            auto b = head;
+            head = b->next;
+            count--;
+            return b;
+        }
+    };
+
+    // The common pool is never destroyed, since threads may still be
+    // exiting (and handing back their blocks) after static destructors
+    // have run.
+    struct poolCommon {
+        std::mutex lk;
+        poolList lists[poolClasses];
+    };
+
+    static poolCommon& commonPool()
+    {
+        static poolCommon* common = new poolCommon();
+        return *common;
+    }
+
+    // Move up to n blocks of class c from one list to another.
+    static void poolMove(poolList& from, poolList& to, size_t n)
+    {
+        while ((n-- > 0) && (from.head != nullptr)) {
+            to.push(from.pop());
+        }
+    }
+
+    static void poolRefill(poolList& to, size_t c)
+    {
+        auto& common = commonPool();
+        std::lock_guard<std::mutex> lk(common.lk);
+        auto& from = common.lists[c];
+        if (from.head == nullptr) {
+            size_t size = (c + 1) * poolQuantum;
+            auto chunk = static_cast<char*>(::operator new(poolChunk));
+            for (size_t off = 0; off + size <= poolChunk; off += size) {
+                from.push(reinterpret_cast<poolBlock*>(chunk + off));
+            }
+        }
+        poolMove(from, to, poolBatch);
+    }
+
+    static void poolReturn(poolList& from, size_t c, size_t n)
+    {
+        auto& common = commonPool();
+        std::lock_guard<std::mutex> lk(common.lk);
+        poolMove(from, common.lists[c], n);
+    }
+
+    // Each thread's lists.  These are plain data, so that using them
+    // costs no more than any other variable; poolExit, which hands them
+    // back when the thread exits, is only touched when they are refilled.
+    // Once it has run, anything the thread frees (from other thread_local
+    // destructors) goes straight to the common pool.
+    static thread_local poolList poolLists[poolClasses];
+    static thread_local bool poolExited;
+
+    struct poolExit {
+        ~poolExit()
+        {
+            for (size_t c = 0; c < poolClasses; c++) {
+                poolReturn(poolLists[c], c, poolLists[c].count);
+            }
+            poolExited = true;
+        }
+    };
+
+    static thread_local poolExit poolExiting;
+
+    void* PoolAlloc(size_t bytes)
+    {
+        if (bytes > poolQuantum * poolClasses) {
+            return ::operator new(bytes);
+        }
+        size_t c = (bytes == 0) ? 0 : (bytes - 1) / poolQuantum;
+        auto& list = poolLists[c];
+        if (list.head == nullptr) {
+            if (poolExited) {
+                poolList one = { nullptr, 0 };
+                poolRefill(one, c);
+                auto b = one.pop();
+                poolReturn(one, c, one.count);
+                return b;
+            }
+            (void)&poolExiting;
+            poolRefill(list, c);
+        }
+        return list.pop();
+    }
+
+    void PoolFree(void* p, size_t bytes)
+    {
+        if (p == nullptr) {
+            return;
+        }
+        if (bytes > poolQuantum * poolClasses) {
+            ::operator delete(p);
+            return;
+        }
+        size_t c = (bytes == 0) ? 0 : (bytes - 1) / poolQuantum;
+        if (poolExited) {
+            poolList one = { nullptr, 0 };
+            one.push(static_cast<poolBlock*>(p));
+            poolReturn(one, c, 1);
+            return;
+        }
+        auto& list = poolLists[c];
+        if (list.head == nullptr) {
+            (void)&poolExiting;
+        }
+        list.push(static_cast<poolBlock*>(p));
+        if (list.count > 4 * poolBatch) {
+            poolReturn(list, c, 2 * poolBatch);
+        }
+    }
+
     // raw event (untyped) -- do not use from application code.
     Event createEvent(const std::string& type)
     {
@@ -77,13 +279,13 @@ namespace analytics {
         return (ev);
     }
 
-    // Add the object into the event.  If the object is null or otherwise
+    // Move the object into the event.  If the object is null or otherwise
     // not a valid JSON object, then any prior value is removed.
     void addEventObject(Event& ev,
-        const std::string& name, const Object& obj)
+        const std::string& name, Object&& obj)
     {
         if (obj.is_object()) {
-            ev[name] = obj;
+            ev[name] = std::move(obj);
         } else {
             ev.erase(name);
         }
@@ -105,11 +307,19 @@ namespace analytics {
         const std::string& event,
         const std::string& userId,
         const Object& properties)
+    {
+        return CreateTrackEvent(event, userId, Object(properties));
+    }
+
+    Event Analytics::CreateTrackEvent(
+        const std::string& event,
+        const std::string& userId,
+        Object&& properties)
     {
         auto ev = createEvent("track");
         addEventString(ev, "event", event);
         addEventString(ev, "userId", userId);
-        addEventObject(ev, "properties", properties);
+        addEventObject(ev, "properties", std::move(properties));
         return (ev);
     }
 
@@ -126,20 +336,34 @@ namespace analytics {
     Event Analytics::CreateIdentifyEvent(
         const std::string& userId,
         const Object& traits)
+    {
+        return CreateIdentifyEvent(userId, Object(traits));
+    }
+
+    Event Analytics::CreateIdentifyEvent(
+        const std::string& userId,
+        Object&& traits)
     {
         auto ev = createEvent("identify");
         addEventString(ev, "userId", userId);
-        addEventObject(ev, "traits", traits);
+        addEventObject(ev, "traits", std::move(traits));
         return (ev);
     }
 
     Event Analytics::CreateGroupEvent(
         const std::string& groupId,
         const Object& traits)
+    {
+        return CreateGroupEvent(groupId, Object(traits));
+    }
+
+    Event Analytics::CreateGroupEvent(
+        const std::string& groupId,
+        Object&& traits)
     {
         auto ev = createEvent("group");
         addEventString(ev, "groupId", groupId);
-        addEventObject(ev, "traits", traits);
+        addEventObject(ev, "traits", std::move(traits));
         return (ev);
     }
 
@@ -147,11 +371,19 @@ namespace analytics {
         const std::string& name,
         const std::string& userId,
         const Object& properties)
+    {
+        return CreatePageEvent(name, userId, Object(properties));
+    }
+
+    Event Analytics::CreatePageEvent(
+        const std::string& name,
+        const std::string& userId,
+        Object&& properties)
     {
         auto ev = createEvent("page");
         addEventString(ev, "name", name);
         addEventString(ev, "userId", userId);
-        addEventObject(ev, "properties", properties);
+        addEventObject(ev, "properties", std::move(properties));
         return (ev);
     }
 
@@ -159,14 +391,971 @@ namespace analytics {
         const std::string& name,
         const std::string& userId,
         const Object& properties)
+    {
+        return CreateScreenEvent(name, userId, Object(properties));
+    }
+
+    Event Analytics::CreateScreenEvent(
+        const std::string& name,
+        const std::string& userId,
+        Object&& properties)
     {
         auto ev = createEvent("screen");
         addEventString(ev, "name", name);
         addEventString(ev, "userId", userId);
-        addEventObject(ev, "properties", properties);
+        addEventObject(ev, "properties", std::move(properties));
         return (ev);
     }
 
+    // Find the first character at or after i that must be escaped in a
+    // JSON string: a quote, a backslash, or a control character.  Returns
+    // n if there is none.
+    static size_t escapeAt(const char* s, size_t i, size_t n)
+    {
+#ifdef SEGMENT_USE_SSE2
+        // Sixteen bytes at a time: c <= 0x1f exactly when max(c, 0x1f)
+        // is 0x1f, comparing without sign.
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i control = _mm_set1_epi8(0x1f);
+        for (; i + 16 <= n; i += 16) {
+            auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            auto hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                _mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+            unsigned mask = unsigned(_mm_movemask_epi8(hit));
+            if (mask != 0) {
+#ifdef _MSC_VER
+                unsigned long bit;
+                _BitScanForward(&bit, mask);
+                return i + bit;
+#else
+                return i + unsigned(__builtin_ctz(mask));
+#endif
+            }
+        }
+#endif
+        for (; i < n; i++) {
+            auto c = static_cast<unsigned char>(s[i]);
+            if ((c < 0x20) || (c == '"') || (c == '\\')) {
+                return i;
+            }
+        }
+        return n;
+    }
+
+    // Append s as a quoted JSON string, escaped exactly as Event::dump
+    // escapes it.  Runs of characters that need no escape are copied
+    // whole.
+    static void appendString(std::string& out, const std::string& s)
+    {
+        static const char hex[] = "0123456789abcdef";
+        out += '"';
+        size_t start = 0;
+        size_t i;
+        while ((i = escapeAt(s.data(), start, s.size())) < s.size()) {
+            auto c = static_cast<unsigned char>(s[i]);
+            out.append(s, start, i - start);
+            start = i + 1;
+            out += '\\';
+            switch (c) {
+            case '"':
+            case '\\':
+                out += char(c);
+                break;
+            case '\b':
+                out += 'b';
+                break;
+            case '\f':
+                out += 'f';
+                break;
+            case '\n':
+                out += 'n';
+                break;
+            case '\r':
+                out += 'r';
+                break;
+            case '\t':
+                out += 't';
+                break;
+            default:
+                out += "u00";
+                out += hex[c >> 4];
+                out += hex[c & 0xf];
+                break;
+            }
+        }
+        out.append(s, start, std::string::npos);
+        out += '"';
+    }
+
+    // Append an integer as Event::dump writes it.
+    static void appendInteger(std::string& out, unsigned long long x, bool negative)
+    {
+        char buf[24];
+        char* p = buf + sizeof(buf);
+        do {
+            *--p = char('0' + x % 10);
+            x /= 10;
+        } while (x != 0);
+        if (negative) {
+            *--p = '-';
+        }
+        out.append(p, buf + sizeof(buf) - p);
+    }
+
+    // Append a floating point number as Event::dump writes it: to 15
+    // significant digits with %g, whatever the locale, and with ".0"
+    // added if that leaves it looking like an integer.
+    static void appendFloat(std::string& out, double x)
+    {
+        if (x == 0) {
+            out += std::signbit(x) ? "-0.0" : "0.0";
+            return;
+        }
+        char buf[64];
+        int n = std::snprintf(buf, sizeof(buf), "%.*g", std::numeric_limits<double>::digits10, x);
+        auto loc = std::localeconv();
+        auto thousands = (loc->thousands_sep != nullptr) ? loc->thousands_sep[0] : '\0';
+        auto point = (loc->decimal_point != nullptr) ? loc->decimal_point[0] : '\0';
+        if (thousands != '\0') {
+            n = int(std::remove(buf, buf + n, thousands) - buf);
+        }
+        if ((point != '\0') && (point != '.')) {
+            std::replace(buf, buf + n, point, '.');
+        }
+        out.append(buf, n);
+        if (std::none_of(buf, buf + n, [](char c) { return (c == '.') || (c == 'e') || (c == 'E'); })) {
+            out += ".0";
+        }
+    }
+
+    void AppendJSON(std::string& out, const Object& value)
+    {
+        switch (value.type()) {
+        case Object::value_t::object: {
+            auto const& members = *value.get_ptr<const Object::object_t*>();
+            out += '{';
+            for (auto const& m : members) {
+                if (&m != &*members.begin()) {
+                    out += ',';
+                }
+                appendString(out, m.first);
+                out += ':';
+                AppendJSON(out, m.second);
+            }
+            out += '}';
+            break;
+        }
+        case Object::value_t::array: {
+            auto const& elements = *value.get_ptr<const Object::array_t*>();
+            out += '[';
+            for (auto const& e : elements) {
+                if (&e != &elements.front()) {
+                    out += ',';
+                }
+                AppendJSON(out, e);
+            }
+            out += ']';
+            break;
+        }
+        case Object::value_t::string:
+            appendString(out, *value.get_ptr<const Object::string_t*>());
+            break;
+        case Object::value_t::boolean:
+            out += *value.get_ptr<const Object::boolean_t*>() ? "true" : "false";
+            break;
+        case Object::value_t::number_integer: {
+            auto x = *value.get_ptr<const Object::number_integer_t*>();
+            appendInteger(out, (x < 0) ? 0 - (unsigned long long)x : (unsigned long long)x, x < 0);
+            break;
+        }
+        case Object::value_t::number_unsigned:
+            appendInteger(out, *value.get_ptr<const Object::number_unsigned_t*>(), false);
+            break;
+        case Object::value_t::number_float:
+            appendFloat(out, *value.get_ptr<const Object::number_float_t*>());
+            break;
+        case Object::value_t::discarded:
+            out += "<discarded>";
+            break;
+        case Object::value_t::null:
+            out += "null";
+            break;
+        }
+    }
+
+    std::string ToJSON(const Object& value)
+    {
+        std::string out;
+        AppendJSON(out, value);
+        return out;
+    }
+
+    // Append "key":value to an object being written, after a comma if it
+    // is not the first member.
+    static void appendKey(std::string& out, const char* key)
+    {
+        if (out.back() != '{') {
+            out += ',';
+        }
+        out += '"';
+        out += key;
+        out += "\":";
+    }
+
+    struct Symbol::entry {
+        std::string name;
+        std::string quoted; // name as a JSON string, quotes and all
+    };
+
+    // Like the common pool, the table of symbols is never destroyed, so
+    // that Symbols held in statics stay good while those are destroyed.
+    // Entries are never removed either; a Symbol points at its own.
+    const Symbol::entry* Symbol::intern(const std::string& s)
+    {
+        struct symbolTable {
+            std::mutex lk;
+            std::unordered_map<std::string, const entry*> entries;
+        };
+        static symbolTable* table = new symbolTable();
+        std::lock_guard<std::mutex> lk(table->lk);
+        auto it = table->entries.find(s);
+        if (it != table->entries.end()) {
+            return it->second;
+        }
+        auto e = new entry();
+        e->name = s;
+        appendString(e->quoted, s);
+        table->entries[s] = e;
+        return e;
+    }
+
+    Symbol::Symbol(const char* s)
+    {
+        e = intern(s);
+    }
+
+    Symbol::Symbol(const std::string& s)
+    {
+        e = intern(s);
+    }
+
+    const std::string& Symbol::str() const
+    {
+        return e->name;
+    }
+
+    const std::string& Symbol::quoted() const
+    {
+        return e->quoted;
+    }
+
+    Properties::Properties()
+    {
+        // Enough for a handful of members without growing.
+        text.reserve(128);
+        text = "{}";
+    }
+
+    // Open a new member at the end of the text, up to its value.
+    void Properties::addKey(const Symbol& key)
+    {
+        text.pop_back();
+        if (text.size() > 1) {
+            text += ',';
+        }
+        text += key.e->quoted;
+        text += ':';
+    }
+
+    Properties& Properties::Set(const Symbol& key, const std::string& value)
+    {
+        addKey(key);
+        appendString(text, value);
+        text += '}';
+        return *this;
+    }
+
+    Properties& Properties::Set(const Symbol& key, const char* value)
+    {
+        return Set(key, std::string(value));
+    }
+
+    Properties& Properties::Set(const Symbol& key, bool value)
+    {
+        addKey(key);
+        text += value ? "true" : "false";
+        text += '}';
+        return *this;
+    }
+
+    Properties& Properties::Set(const Symbol& key, double value)
+    {
+        // JSON has no NaN or infinity; Object stores them as null, and so
+        // do we.
+        addKey(key);
+        if (std::isfinite(value)) {
+            appendFloat(text, value);
+        } else {
+            text += "null";
+        }
+        text += '}';
+        return *this;
+    }
+
+    Properties& Properties::Set(const Symbol& key, const Properties& value)
+    {
+        addKey(key);
+        text += value.text;
+        text += '}';
+        return *this;
+    }
+
+    Properties& Properties::Set(const Symbol& key, const Object& value)
+    {
+        addKey(key);
+        AppendJSON(text, value);
+        text += '}';
+        return *this;
+    }
+
+    Properties& Properties::setInteger(const Symbol& key, long long value)
+    {
+        addKey(key);
+        appendInteger(text, (value < 0) ? 0 - (unsigned long long)value : (unsigned long long)value, value < 0);
+        text += '}';
+        return *this;
+    }
+
+    Properties& Properties::setUnsigned(const Symbol& key, unsigned long long value)
+    {
+        addKey(key);
+        appendInteger(text, value, false);
+        text += '}';
+        return *this;
+    }
+
+    // envelope is an event posted by Track, Identify and the like, held
+    // as its fixed fields instead of as a tree.  It points at the caller's
+    // arguments rather than copying them, so it must not outlive the call
+    // that made it.  dump writes it byte for byte as Event::dump would
+    // write the same event built by the Create*Event functions: the same
+    // keys, in the same (sorted) order, with the same escapes, leaving
+    // out empty strings and objects that are not objects.  Only the
+    // objects that the caller supplies are JSON.  Properties built as
+    // text are written as they are (and so in the order they were set).
+    struct Analytics::envelope {
+        envelope(const char* type)
+            : type(type)
+            , userId(nullptr)
+            , anonymousId(nullptr)
+            , event(nullptr)
+            , symbol(nullptr)
+            , name(nullptr)
+            , previousId(nullptr)
+            , groupId(nullptr)
+            , properties(nullptr)
+            , traits(nullptr)
+            , context(nullptr)
+            , integrations(nullptr)
+            , built(nullptr)
+        {
+        }
+
+        std::string dump() const
+        {
+            // Render the objects first, so that the result can be sized
+            // up front.  The escapes in strings are usually few enough to
+            // fit in the slack.
+            std::string objects[4];
+            const Object* from[4] = { context, integrations, properties, traits };
+            size_t size = 64;
+            for (int i = 0; i < 4; i++) {
+                if ((from[i] != nullptr) && from[i]->is_object()) {
+                    AppendJSON(objects[i], *from[i]);
+                    size += objects[i].size() + 16;
+                }
+            }
+            if (built != nullptr) {
+                size += built->Dump().size() + 16;
+            }
+            if (symbol != nullptr) {
+                size += symbol->quoted().size() + 16;
+            }
+            const std::string* strings[] = { userId, anonymousId, event, name, previousId, groupId };
+            for (auto s : strings) {
+                if (s != nullptr) {
+                    size += s->size() + 16;
+                }
+            }
+
+            std::string out;
+            out.reserve(size);
+            out += '{';
+            addString(out, "anonymousId", anonymousId);
+            addObject(out, "context", objects[0]);
+            if (symbol != nullptr) {
+                addQuoted(out, "event", *symbol);
+            } else {
+                addString(out, "event", event);
+            }
+            addString(out, "groupId", groupId);
+            addObject(out, "integrations", objects[1]);
+            addString(out, "name", name);
+            addString(out, "previousId", previousId);
+            addObject(out, "properties", (built != nullptr) ? built->Dump() : objects[2]);
+            appendKey(out, "timestamp");
+            out += '"';
+            appendTimeStamp(out, std::chrono::system_clock::now());
+            out += '"';
+            addObject(out, "traits", objects[3]);
+            appendKey(out, "type");
+            out += '"';
+            out += type;
+            out += '"';
+            addString(out, "userId", userId);
+            out += '}';
+            return out;
+        }
+
+        static void addString(std::string& out, const char* key, const std::string* val)
+        {
+            if ((val != nullptr) && !val->empty()) {
+                appendKey(out, key);
+                appendString(out, *val);
+            }
+        }
+
+        static void addQuoted(std::string& out, const char* key, const Symbol& val)
+        {
+            if (!val.str().empty()) {
+                appendKey(out, key);
+                out += val.quoted();
+            }
+        }
+
+        static void addObject(std::string& out, const char* key, const std::string& dumped)
+        {
+            if (!dumped.empty()) {
+                appendKey(out, key);
+                out += dumped;
+            }
+        }
+
+        const char* type;
+        const std::string* userId;
+        const std::string* anonymousId;
+        const std::string* event;
+        const Symbol* symbol; // in place of event, already quoted
+        const std::string* name;
+        const std::string* previousId;
+        const std::string* groupId;
+        const Object* properties;
+        const Object* traits;
+        const Object* context;
+        const Object* integrations;
+        const Properties* built; // in place of properties
+    };
+
+    // inbox is a multi-producer, single-consumer queue of events, after
+    // Dmitry Vyukov's intrusive MPSC node queue.  Pushing is wait-free:
+    // one atomic exchange, and one store.  Consumers must be serialized
+    // by the caller; we only pop while holding Analytics::lock.
+    class Analytics::inbox {
+    public:
+        inbox()
+            : head(&stub)
+            , tail(&stub)
+            , count(0)
+        {
+            stub.next = nullptr;
+        }
+
+        ~inbox()
+        {
+            queued q;
+            while (pop(q)) {
+            }
+        }
+
+        void push(queued&& q)
+        {
+            auto n = new node;
+            n->item = std::move(q);
+            link(n);
+            count++;
+        }
+
+        bool pop(queued& q)
+        {
+            auto n = take();
+            if (n == nullptr) {
+                return false;
+            }
+            q = std::move(n->item);
+            delete n;
+            count--;
+            return true;
+        }
+
+        // This may briefly report an item as missing while its push is
+        // still in progress, but never the reverse.  That is sufficient,
+        // as a producer always checks for a sleeping worker after the
+        // count is updated.
+        bool empty() const { return count <= 0; }
+
+    private:
+        struct node {
+            std::atomic<node*> next;
+            queued item;
+        };
+
+        void link(node* n)
+        {
+            n->next.store(nullptr, std::memory_order_relaxed);
+            auto prev = head.exchange(n);
+            prev->next.store(n, std::memory_order_release);
+        }
+
+        node* take()
+        {
+            auto t = tail;
+            auto next = t->next.load(std::memory_order_acquire);
+            if (t == &stub) {
+                if (next == nullptr) {
+                    return nullptr;
+                }
+                tail = t = next;
+                next = next->next.load(std::memory_order_acquire);
+            }
+            if (next != nullptr) {
+                tail = next;
+                return t;
+            }
+            if (t != head.load()) {
+                return nullptr; // a push is still in progress
+            }
+            link(&stub);
+            next = t->next.load(std::memory_order_acquire);
+            if (next != nullptr) {
+                tail = next;
+                return t;
+            }
+            return nullptr;
+        }
+
+        std::atomic<node*> head;
+        node* tail;
+        node stub;
+        std::atomic<long> count; // signed; pop may run ahead of count++
+    };
+
+    // retryQueue holds batches waiting to be retried, as a binary heap
+    // ordered by when each is due.  Finding the next deadline is O(1),
+    // and adding or removing a batch is O(log n), however many batches
+    // are waiting.  Batches due at the same instant come out in the order
+    // they went in.
+    class Analytics::retryQueue {
+    public:
+        retryQueue()
+            : seq(0)
+        {
+        }
+
+        void push(std::unique_ptr<outgoing> b)
+        {
+            entry e;
+            e.when = b->retryTime;
+            e.seq = seq++;
+            e.b = std::move(b);
+            heap.push_back(std::move(e));
+            std::push_heap(heap.begin(), heap.end(), later);
+        }
+
+        bool empty() const { return heap.empty(); }
+
+        // The earliest deadline, or timePoint::max() if there is none.
+        timePoint next() const
+        {
+            return heap.empty() ? timePoint::max() : heap.front().when;
+        }
+
+        // Remove and return a batch that is due by now, if there is one.
+        std::unique_ptr<outgoing> popDue(timePoint now)
+        {
+            if (heap.empty() || (heap.front().when > now)) {
+                return nullptr;
+            }
+            std::pop_heap(heap.begin(), heap.end(), later);
+            auto b = std::move(heap.back().b);
+            heap.pop_back();
+            return b;
+        }
+
+    private:
+        struct entry {
+            timePoint when;
+            uint64_t seq;
+            std::unique_ptr<outgoing> b;
+        };
+
+        // std::push_heap builds a max-heap; invert it to get the earliest.
+        static bool later(const entry& x, const entry& y)
+        {
+            return (x.when > y.when) || ((x.when == y.when) && (x.seq > y.seq));
+        }
+
+        std::vector<entry> heap;
+        uint64_t seq;
+    };
+
+    // How the rate limiter adapts: the slowest it will go, in batches per
+    // second; how much it slows down when refused; and how quickly it
+    // recovers, in batches per second, per second.
+    static const double minRate = 1.0;
+    static const double decrease = 0.5;
+    static const double increase = 1.0;
+
+    // rateLimiter paces the start of batches with additive increase and
+    // multiplicative decrease.  It stays out of the way until the server
+    // pushes back with 429 or a 5xx; then it halves the rate at which
+    // batches may start, and adds a little back with each success.  A
+    // Retry-After from the server holds back everything until the time
+    // it gives.  Called with the lock held.
+    class Analytics::rateLimiter {
+    public:
+        rateLimiter()
+            : rate(0)
+            , throttled(0)
+            , observed(0)
+            , next(timePoint::min())
+            , hold(timePoint::min())
+            , cut(timePoint::min())
+            , last(timePoint::min())
+        {
+        }
+
+        // The earliest time at which another batch may start.
+        timePoint ready() const { return std::max(next, hold); }
+
+        bool allows(timePoint now) const { return now >= ready(); }
+
+        // A batch is starting now.
+        void started(timePoint now)
+        {
+            // Keep an eye on the rate we actually start batches at, so
+            // that there is somewhere sensible to back off from.
+            if (last != timePoint::min()) {
+                double gap = std::chrono::duration<double>(now - last).count();
+                double inst = (gap > 0.001) ? (1.0 / gap) : 1000.0;
+                observed = (observed == 0) ? inst : (0.9 * observed + 0.1 * inst);
+            }
+            last = now;
+            if (rate > 0) {
+                next = std::max(now, next) + interval();
+            }
+        }
+
+        // A batch has finished an attempt.
+        void finished(const outgoing& b, timePoint now, bool adapt)
+        {
+            if (b.retryAfter > hold) {
+                hold = b.retryAfter;
+            }
+            if (b.status == 429) {
+                throttled++;
+            }
+            if (!adapt) {
+                rate = 0;
+                next = timePoint::min();
+                return;
+            }
+            if (b.ok) {
+                if (rate > 0) {
+                    rate += increase / rate;
+                }
+                return;
+            }
+            // Batches that were already under way when we last backed off
+            // tell us nothing new; without this, a burst of refusals for
+            // batches in flight together would cut the rate many times.
+            if (((b.status == 429) || ((b.status >= 500) && (b.status <= 599))) && (b.sentTime >= cut)) {
+                double from = (rate > 0) ? rate : std::max(observed, minRate);
+                rate = std::max(minRate, from * decrease);
+                cut = now;
+                next = std::max(next, now + interval());
+            }
+        }
+
+        double rate; // batches per second; zero while not limiting
+        uint64_t throttled;
+
+    private:
+        std::chrono::steady_clock::duration interval() const
+        {
+            return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(1.0 / rate));
+        }
+
+        double observed;
+        timePoint next;
+        timePoint hold;
+        timePoint cut;
+        timePoint last;
+    };
+
+    // spool is a FIFO of serialized events, kept in memory-mapped, append
+    // only segment files.  Each record is a 32-bit length (in host order)
+    // followed by the event.  Segments are created at full size, and so
+    // are zero filled: a zero length marks the end of the records written
+    // so far.  The event is written before its length, so a record torn
+    // by a crash is never seen.  Reading a record marks it by setting the
+    // top bit of its length, so that it is not read again after a restart,
+    // and a segment is deleted once every record in it has been read.  The
+    // next bit carries the event's queued::asIs.
+    // Segments left by an earlier run are read, but never appended to.
+    class Analytics::spool {
+    public:
+        spool(const std::string& dir, size_t segmentSize);
+        ~spool();
+
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+        void push(const queued& q);
+        bool pop(queued& q);
+
+    private:
+        struct segment {
+            uint64_t seq;
+            std::string path;
+            int fd;
+            char* base;
+            size_t size;
+            size_t rpos; // first record not yet read
+            size_t wpos; // end of the records written
+        };
+
+        static const uint32_t readMark = 0x80000000u;
+        static const uint32_t asIsMark = 0x40000000u;
+
+        void create(size_t size);
+        void scan(segment&);
+        void close(segment&, bool remove);
+
+        std::string dir;
+        size_t segmentSize;
+        std::deque<segment> segs; // oldest first
+        bool appending; // true if segs.back() is ours to append to
+        uint64_t nextSeq;
+        size_t count;
+    };
+
+#ifndef _WIN32
+    static std::system_error spoolError(const std::string& what)
+    {
+        return std::system_error(errno, std::system_category(), what);
+    }
+
+    Analytics::spool::spool(const std::string& dir, size_t segmentSize)
+        : dir(dir)
+        , segmentSize(segmentSize)
+        , appending(false)
+        , nextSeq(0)
+        , count(0)
+    {
+        std::vector<uint64_t> found;
+        DIR* d = opendir(dir.c_str());
+        if (d == nullptr) {
+            throw spoolError(dir);
+        }
+        while (struct dirent* ent = readdir(d)) {
+            unsigned long long seq;
+            char tail;
+            if (std::sscanf(ent->d_name, "segment-%16llx.spil%c", &seq, &tail) == 2 && tail == 'l') {
+                found.push_back(seq);
+            }
+        }
+        closedir(d);
+        std::sort(found.begin(), found.end());
+
+        for (auto seq : found) {
+            char name[64];
+            std::snprintf(name, sizeof(name), "/segment-%016llx.spill", (unsigned long long)seq);
+            segment seg;
+            seg.seq = seq;
+            seg.path = dir + name;
+            seg.fd = open(seg.path.c_str(), O_RDWR);
+            if (seg.fd < 0) {
+                throw spoolError(seg.path);
+            }
+            struct stat st;
+            if (fstat(seg.fd, &st) != 0) {
+                auto e = spoolError(seg.path);
+                ::close(seg.fd);
+                throw e;
+            }
+            seg.size = size_t(st.st_size);
+            seg.base = nullptr;
+            if (seg.size > 0) {
+                void* m = mmap(nullptr, seg.size, PROT_READ | PROT_WRITE, MAP_SHARED, seg.fd, 0);
+                if (m == MAP_FAILED) {
+                    auto e = spoolError(seg.path);
+                    ::close(seg.fd);
+                    throw e;
+                }
+                seg.base = static_cast<char*>(m);
+            }
+            scan(seg);
+            nextSeq = seq + 1;
+            if (seg.rpos == seg.wpos) {
+                close(seg, true); // nothing left unread
+            } else {
+                segs.push_back(seg);
+            }
+        }
+    }
+
+    Analytics::spool::~spool()
+    {
+        for (auto& seg : segs) {
+            close(seg, seg.rpos == seg.wpos);
+        }
+    }
+
+    // Find the records in a segment we did not write ourselves.
+    void Analytics::spool::scan(segment& seg)
+    {
+        size_t pos = 0;
+        bool unread = false;
+        seg.rpos = 0;
+        while (pos + 4 <= seg.size) {
+            uint32_t len;
+            std::memcpy(&len, seg.base + pos, 4);
+            size_t n = len & ~(readMark | asIsMark);
+            if ((len == 0) || (pos + 4 + n > seg.size)) {
+                break;
+            }
+            if ((len & readMark) == 0) {
+                count++;
+                if (!unread) {
+                    seg.rpos = pos;
+                    unread = true;
+                }
+            }
+            pos += 4 + n;
+        }
+        seg.wpos = pos;
+        if (!unread) {
+            seg.rpos = pos;
+        }
+    }
+
+    void Analytics::spool::create(size_t size)
+    {
+        char name[64];
+        std::snprintf(name, sizeof(name), "/segment-%016llx.spill", (unsigned long long)nextSeq);
+        segment seg;
+        seg.seq = nextSeq++;
+        seg.path = dir + name;
+        seg.size = size;
+        seg.rpos = 0;
+        seg.wpos = 0;
+        seg.fd = open(seg.path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (seg.fd < 0) {
+            throw spoolError(seg.path);
+        }
+        void* m = MAP_FAILED;
+        if (ftruncate(seg.fd, off_t(size)) == 0) {
+            m = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg.fd, 0);
+        }
+        if (m == MAP_FAILED) {
+            auto e = spoolError(seg.path);
+            ::close(seg.fd);
+            unlink(seg.path.c_str());
+            throw e;
+        }
+        seg.base = static_cast<char*>(m);
+        segs.push_back(seg);
+        appending = true;
+    }
+
+    void Analytics::spool::close(segment& seg, bool remove)
+    {
+        if (seg.base != nullptr) {
+            munmap(seg.base, seg.size);
+        }
+        ::close(seg.fd);
+        if (remove) {
+            unlink(seg.path.c_str());
+        }
+    }
+
+    void Analytics::spool::push(const queued& q)
+    {
+        auto const& data = q.data;
+        if (data.size() >= asIsMark) {
+            throw std::length_error("event too large to spill");
+        }
+        size_t need = 4 + data.size();
+        if ((!appending) || (segs.back().wpos + need > segs.back().size)) {
+            create(std::max(segmentSize, need));
+        }
+        auto& seg = segs.back();
+        uint32_t len = uint32_t(data.size()) | (q.asIs ? asIsMark : 0);
+        std::memcpy(seg.base + seg.wpos + 4, data.data(), data.size());
+        std::memcpy(seg.base + seg.wpos, &len, 4);
+        seg.wpos += need;
+        count++;
+    }
+
+    bool Analytics::spool::pop(queued& q)
+    {
+        while (!segs.empty()) {
+            auto& seg = segs.front();
+            if (seg.rpos < seg.wpos) {
+                uint32_t len;
+                std::memcpy(&len, seg.base + seg.rpos, 4);
+                q.asIs = (len & asIsMark) != 0;
+                q.data.assign(seg.base + seg.rpos + 4, len & ~asIsMark);
+                len |= readMark;
+                std::memcpy(seg.base + seg.rpos, &len, 4);
+                seg.rpos += 4 + q.data.size();
+                count--;
+                return true;
+            }
+            if (appending && (segs.size() == 1)) {
+                return false; // we may yet write more here
+            }
+            close(seg, true);
+            segs.pop_front();
+        }
+        return false;
+    }
+#else
+    // Spilling needs a port to Windows file mappings.
+    Analytics::spool::spool(const std::string&, size_t)
+    {
+        throw std::system_error(std::make_error_code(std::errc::not_supported));
+    }
+    Analytics::spool::~spool() {}
+    void Analytics::spool::push(const queued&) {}
+    bool Analytics::spool::pop(queued&) { return false; }
+#endif
+
+    // The batch body is {"batch":[e1,e2,...]}.  Empty, that is 12 bytes;
+    // each event then adds its own size, plus a comma after the first.
+    static const size_t emptyBatchSize = sizeof("{\"batch\":[]}") - 1;
+
+    // Each event is stamped with sentAt as it is written into a body,
+    // which makes it up to this much longer.
+    static const size_t sentAtSize = sizeof("\"sentAt\":\"2017-06-01T17:23:45.678Z\",") - 1;
+
+    // The room an event takes in a batch body.
+    static size_t wireSize(const std::string& data)
+    {
+        return data.size() + sentAtSize;
+    }
+
     Object initContext()
     {
         auto context = json::object();
@@ -198,16 +1387,52 @@ namespace analytics {
 #else
         Handler = std::make_shared<segment::http::HandlerNone>();
 #endif
-        thr = std::thread(worker, this);
+        incoming.reset(new inbox());
+        retrying.reset(new retryQueue());
+        limiter.reset(new rateLimiter());
+        AdaptiveRate = true;
+        spilledEvents = 0;
+        persisting = false;
+        SpillThreshold = 10000;
+        SpillSegmentSize = 4 * 1024 * 1024;
+        sleeping = false;
         MaxRetries = 5;
+        Retry = std::make_shared<RetryPolicy>();
         RetryInterval = std::chrono::seconds(1);
+        retryInterval = RetryInterval;
+        MaxSplitDepth = 8;
+        MaxInFlight = 1;
+        MaxQueuedEvents = 0;
+        MaxQueuedBytes = 0;
+        Overflow = OverflowPolicy::DropNewest;
+        BlockTimeout = std::chrono::seconds(1);
+        Encoding = Compression::None;
+        CompressionLevel = 6;
+        FlushSizeCompressed = false;
+        compressRatio = 1.0;
+        queuedEvents = 0;
+        queuedBytes = 0;
+        droppedNewest = 0;
+        droppedOldest = 0;
+        droppedSampled = 0;
+        droppedTimeout = 0;
+        blocked = 0;
         shutdown = false;
+        stopping = false;
+        warming = false;
         FlushCount = 250;
         FlushSize = 500 * 1024;
         FlushInterval = std::chrono::seconds(10);
         needFlush = false;
-        wakeTime = std::chrono::time_point<std::chrono::system_clock>::max();
+        batchSize = emptyBatchSize;
+        outstanding = 0;
+        splitBatches = 0;
+        isolatedEvents = 0;
+        idleSenders = 0;
+        wakeTime = timePoint::max();
         Context = initContext();
+        envelopeStale = true;
+        thr = std::thread(worker, this);
     }
 
     Analytics::Analytics(std::string writeKey, std::string host)
@@ -222,55 +1447,216 @@ namespace analytics {
         Handler = std::make_shared<segment::http::HandlerNone>();
 #endif
 
-        thr = std::thread(worker, this);
+        incoming.reset(new inbox());
+        retrying.reset(new retryQueue());
+        limiter.reset(new rateLimiter());
+        AdaptiveRate = true;
+        spilledEvents = 0;
+        persisting = false;
+        SpillThreshold = 10000;
+        SpillSegmentSize = 4 * 1024 * 1024;
+        sleeping = false;
         MaxRetries = 5;
+        Retry = std::make_shared<RetryPolicy>();
         RetryInterval = std::chrono::seconds(1);
+        retryInterval = RetryInterval;
+        MaxSplitDepth = 8;
+        MaxInFlight = 1;
+        MaxQueuedEvents = 0;
+        MaxQueuedBytes = 0;
+        Overflow = OverflowPolicy::DropNewest;
+        BlockTimeout = std::chrono::seconds(1);
+        Encoding = Compression::None;
+        CompressionLevel = 6;
+        FlushSizeCompressed = false;
+        compressRatio = 1.0;
+        queuedEvents = 0;
+        queuedBytes = 0;
+        droppedNewest = 0;
+        droppedOldest = 0;
+        droppedSampled = 0;
+        droppedTimeout = 0;
+        blocked = 0;
         shutdown = false;
+        stopping = false;
+        warming = false;
         FlushCount = 250;
         FlushSize = 500 * 1024;
         FlushInterval = std::chrono::seconds(10);
         needFlush = false;
-        wakeTime = std::chrono::time_point<std::chrono::system_clock>::max();
+        batchSize = emptyBatchSize;
+        outstanding = 0;
+        splitBatches = 0;
+        isolatedEvents = 0;
+        idleSenders = 0;
+        wakeTime = timePoint::max();
         Context = initContext();
+        envelopeStale = true;
+        thr = std::thread(worker, this);
+    }
+
+    Analytics::~Analytics()
+    {
+        {
+            // Anything spilled stays on disk for next time.
+            std::lock_guard<std::mutex> lk(this->lock);
+            persisting = true;
+        }
+        FlushWait();
+        std::unique_lock<std::mutex> lk(this->lock);
+        shutdown = true;
+        flushCv.notify_one();
+        lk.unlock();
+
+        thr.join();
+    }
+
+    void Analytics::FlushWait()
+    {
+        std::unique_lock<std::mutex> lk(this->lock);
+
+        // NB: If an event has been taken off the queue and is being
+        // processed, then the lock will be held, preventing us from
+        // executing this check.
+        while (!idle()) {
+            needFlush = true;
+            flushCv.notify_one();
+            emptyCv.wait(lk);
+        }
+    }
+
+    void Analytics::Flush()
+    {
+        std::lock_guard<std::mutex> lk(this->lock);
+        needFlush = true;
+        flushCv.notify_one();
+    }
+
+    void Analytics::Scrub()
+    {
+        std::lock_guard<std::mutex> lk(this->lock);
+        queued q;
+        size_t count = 0;
+        size_t bytes = 0;
+        while (incoming->pop(q)) {
+            count++;
+            bytes += q.data.size();
+        }
+        for (auto const& e : events) {
+            bytes += e.data.size();
+        }
+        for (auto const& e : batch) {
+            bytes += e.data.size();
+        }
+        count += events.size() + batch.size();
+        events.clear();
+        batch.clear();
+        batchSize = emptyBatchSize;
+        release(count, bytes);
+        emptyCv.notify_all();
+        flushCv.notify_one();
+    }
+
+    void Analytics::Prewarm()
+    {
+        std::lock_guard<std::mutex> lk(this->lock);
+        warming = true;
+        startSender();
+        sendCv.notify_one();
     }
 
-    Analytics::~Analytics()
+    RetryPolicy::RetryPolicy()
     {
-        FlushWait();
-        std::unique_lock<std::mutex> lk(this->lock);
-        shutdown = true;
-        flushCv.notify_one();
-        lk.unlock();
+        BaseDelay = std::chrono::seconds(1);
+        MaxDelay = std::chrono::seconds(30);
+        Jitter = true;
+    }
 
-        thr.join();
+    FailureKind RetryPolicy::Classify(int status)
+    {
+        if ((status == 0) || (status == 408)) {
+            return FailureKind::Network;
+        }
+        if (status == 429) {
+            return FailureKind::Throttled;
+        }
+        if (status == 400) {
+            return FailureKind::Malformed;
+        }
+        if (status == 413) {
+            return FailureKind::TooLarge;
+        }
+        if ((status >= 400) && (status <= 499)) {
+            return FailureKind::Client;
+        }
+        if ((status >= 500) && (status <= 599)) {
+            return FailureKind::Server;
+        }
+        return FailureKind::Other;
     }
 
-    void Analytics::FlushWait()
+    bool RetryPolicy::Retryable(FailureKind kind) const
     {
-        std::unique_lock<std::mutex> lk(this->lock);
+        switch (kind) {
+        case FailureKind::Network:
+        case FailureKind::Throttled:
+        case FailureKind::Server:
+            return true;
+        default:
+            // The same batch would only be refused again.
+            return false;
+        }
+    }
 
-        // NB: If an event has been taken off the queue and is being
-        // processed, then the lock will be held, preventing us from
-        // executing this check.
-        while (!events.empty()) {
-            needFlush = true;
-            flushCv.notify_one();
-            emptyCv.wait(lk);
+    bool RetryPolicy::Splittable(FailureKind kind) const
+    {
+        return (kind == FailureKind::Malformed) || (kind == FailureKind::TooLarge);
+    }
+
+    std::chrono::milliseconds RetryPolicy::Backoff(int retry) const
+    {
+        // Double for each retry, taking care not to overflow on the way
+        // to the cap.
+        auto delay = BaseDelay;
+        for (int i = 1; (i < retry) && (delay < MaxDelay); i++) {
+            delay *= 2;
+        }
+        delay = std::min(delay, MaxDelay);
+        if (Jitter && (delay.count() > 0)) {
+            static thread_local std::minstd_rand rng(std::random_device{}());
+            std::uniform_int_distribution<long long> pick(0, delay.count());
+            delay = std::chrono::milliseconds(pick(rng));
         }
+        return delay;
     }
 
-    void Analytics::Flush()
+    Metrics Analytics::GetMetrics()
     {
+        Metrics m;
+        m.QueuedEvents = queuedEvents;
+        m.QueuedBytes = queuedBytes;
+        m.DroppedNewest = droppedNewest;
+        m.DroppedOldest = droppedOldest;
+        m.DroppedSampled = droppedSampled;
+        m.DroppedTimeout = droppedTimeout;
+        m.SpilledEvents = spilledEvents;
         std::lock_guard<std::mutex> lk(this->lock);
-        needFlush = true;
-        flushCv.notify_one();
+        m.SendRate = limiter->rate;
+        m.Throttled = limiter->throttled;
+        m.SplitBatches = splitBatches;
+        m.IsolatedEvents = isolatedEvents;
+        return m;
     }
 
-    void Analytics::Scrub()
+    void Analytics::EnableSpill(const std::string& directory)
     {
+        std::unique_ptr<spool> sp(new spool(directory, SpillSegmentSize));
         std::lock_guard<std::mutex> lk(this->lock);
-        events.clear();
-        emptyCv.notify_all();
+        if (spilled != nullptr) {
+            throw std::invalid_argument("spilling is already enabled");
+        }
+        spilledEvents = sp->size();
+        spilled = std::move(sp);
         flushCv.notify_one();
     }
 
@@ -290,12 +1676,28 @@ namespace analytics {
         const Object& context,
         const Object& integrations)
     {
-        auto ev = CreateTrackEvent(event, userId, properties);
-        addEventString(ev, "anonymousId", anonymousId);
-        addEventObject(ev, "context", context);
-        addEventObject(ev, "integrations", integrations);
+        envelope env("track");
+        env.event = &event;
+        env.userId = &userId;
+        env.anonymousId = &anonymousId;
+        env.properties = &properties;
+        env.context = &context;
+        env.integrations = &integrations;
+
+        queueData(env.dump());
+    }
+
+    void Analytics::Track(
+        const std::string& userId,
+        const Symbol& event,
+        const Properties& properties)
+    {
+        envelope env("track");
+        env.symbol = &event;
+        env.userId = &userId;
+        env.built = &properties;
 
-        queueEvent(std::move(ev));
+        queueData(env.dump());
     }
 
     void Analytics::Identify(
@@ -312,12 +1714,14 @@ namespace analytics {
         const Object& context,
         const Object& integrations)
     {
-        auto ev = CreateIdentifyEvent(userId, traits);
-        addEventString(ev, "anonymousId", anonymousId);
-        addEventObject(ev, "context", context);
-        addEventObject(ev, "integrations", integrations);
-
-        queueEvent(std::move(ev));
+        envelope env("identify");
+        env.userId = &userId;
+        env.anonymousId = &anonymousId;
+        env.traits = &traits;
+        env.context = &context;
+        env.integrations = &integrations;
+
+        queueData(env.dump());
     }
 
     void Analytics::Page(
@@ -336,12 +1740,15 @@ namespace analytics {
         const Object& context,
         const Object& integrations)
     {
-        auto ev = CreatePageEvent(name, userId, properties);
-        addEventString(ev, "anonymousId", anonymousId);
-        addEventObject(ev, "context", context);
-        addEventObject(ev, "integrations", integrations);
-
-        queueEvent(std::move(ev));
+        envelope env("page");
+        env.name = &name;
+        env.userId = &userId;
+        env.anonymousId = &anonymousId;
+        env.properties = &properties;
+        env.context = &context;
+        env.integrations = &integrations;
+
+        queueData(env.dump());
     }
     void Analytics::Screen(
         const std::string& name,
@@ -359,12 +1766,15 @@ namespace analytics {
         const Object& context,
         const Object& integrations)
     {
-        auto ev = CreateScreenEvent(name, userId, properties);
-        addEventString(ev, "anonymousId", anonymousId);
-        addEventObject(ev, "context", context);
-        addEventObject(ev, "integrations", integrations);
-
-        queueEvent(std::move(ev));
+        envelope env("screen");
+        env.name = &name;
+        env.userId = &userId;
+        env.anonymousId = &anonymousId;
+        env.properties = &properties;
+        env.context = &context;
+        env.integrations = &integrations;
+
+        queueData(env.dump());
     }
 
     void Analytics::Alias(
@@ -381,12 +1791,14 @@ namespace analytics {
         const Object& context,
         const Object& integrations)
     {
-        auto ev = CreateAliasEvent(previousId, userId);
-        addEventString(ev, "anonymousId", anonymousId);
-        addEventObject(ev, "context", context);
-        addEventObject(ev, "integrations", integrations);
-
-        queueEvent(std::move(ev));
+        envelope env("alias");
+        env.previousId = &previousId;
+        env.userId = &userId;
+        env.anonymousId = &anonymousId;
+        env.context = &context;
+        env.integrations = &integrations;
+
+        queueData(env.dump());
     }
 
     void Analytics::Group(
@@ -406,17 +1818,27 @@ namespace analytics {
         const Object& context,
         const Object& integrations)
     {
-        auto ev = CreateGroupEvent(groupId, traits);
-        addEventString(ev, "anonymousId", anonymousId);
-        addEventObject(ev, "context", context);
-        addEventObject(ev, "integrations", integrations);
+        envelope env("group");
+        env.groupId = &groupId;
+        env.userId = &userId;
+        env.anonymousId = &anonymousId;
+        env.traits = &traits;
+        env.context = &context;
+        env.integrations = &integrations;
+
+        queueData(env.dump());
+    }
 
-        queueEvent(std::move(ev));
+    void Analytics::PostEvent(const Event& ev)
+    {
+        queueEvent(ev);
     }
 
-    void Analytics::PostEvent(Event ev)
+    void Analytics::PostEvent(Event&& ev)
     {
-        queueEvent(std::move(ev));
+        // Take the tree over, so that it goes as soon as it is written.
+        Event owned(std::move(ev));
+        queueEvent(owned);
     }
 
     // This implementation of base64 is taken from StackOverflow:
@@ -444,88 +1866,669 @@ namespace analytics {
         return out;
     }
 
-    void Analytics::sendBatch()
+    // Compress a request body in place, and label it to match.  Returns
+    // false, leaving the body alone, if there is nothing to do (or no way
+    // to do it).
+    static bool compressBody(segment::http::Request& req, Compression enc, int level)
     {
-        segment::http::Request req;
-        // XXX add default context or integrations?
+#ifdef SEGMENT_USE_ZLIB
+        if (enc == Compression::None) {
+            return false;
+        }
+        z_stream zs;
+        std::memset(&zs, 0, sizeof(zs));
+        // 15 bits of window; adding 16 asks zlib for a gzip wrapper.
+        int bits = (enc == Compression::Gzip) ? 15 + 16 : 15;
+        if (deflateInit2(&zs, level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::bad_alloc();
+        }
+        std::string out;
+        out.resize(deflateBound(&zs, uLong(req.Body.size())));
+        zs.next_in = reinterpret_cast<Bytef*>(&req.Body[0]);
+        zs.avail_in = uInt(req.Body.size());
+        zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+        zs.avail_out = uInt(out.size());
+        int rv = deflate(&zs, Z_FINISH);
+        out.resize(zs.total_out);
+        deflateEnd(&zs);
+        if (rv != Z_STREAM_END) {
+            throw std::runtime_error("Compression failed");
+        }
+        req.Body = std::move(out);
+        req.Headers["Content-Encoding"] = (enc == Compression::Gzip) ? "gzip" : "deflate";
+        return true;
+#else
+        (void)req;
+        (void)enc;
+        (void)level;
+        return false;
+#endif
+    }
 
-        auto tmstamp = TimeStamp();
-        // Update the time on the elements of the batch.  We do this
-        // on each new attempt, since we're trying to synchronize our clock
-        // with the server's.
-        for (auto ev : batch) {
-            ev["sentAt"] = tmstamp;
+    // Render the parts of a batch request common to every batch, unless
+    // they already are.  They depend only on the write key and host, which
+    // never change, and on Context and Integrations, which are rendered
+    // as they were when the first batch was sent, or as last set with
+    // SetContext or SetIntegrations.  Called with the lock held.
+    void Analytics::renderEnvelope()
+    {
+        if (!envelopeStale) {
+            return;
         }
 
-        json body;
-        body["batch"] = batch;
+        std::map<std::string, std::string> headers;
+
+        // Send user agent in the form of {library_name}/{library_version} as per RFC 7231.
+        // Context may hold anything, so look before reading.
+        auto part = [this](const char* key) -> std::string {
+            auto lib = Context.find("library");
+            if ((lib == Context.end()) || !lib->is_object()) {
+                return "null";
+            }
+            auto it = lib->find(key);
+            if (it == lib->end()) {
+                return "null";
+            }
+            return it->is_string() ? it->get<std::string>() : ToJSON(*it);
+        };
+        auto userAgent = part("name") + "/" + part("version");
+        userAgent.erase(std::remove(userAgent.begin(), userAgent.end(), '"'), userAgent.end());
+        headers["User-Agent"] = userAgent;
+
+        // Note: libcurl could do this for us, but for other transports
+        // we do it here -- keeping the transports as unaware as possible.
+        headers["Authorization"] = "Basic " + base64_encode(this->writeKey + ":");
+        headers["Content-Type"] = "application/json";
+        headers["Accept"] = "application/json";
+
+        batchURL = this->host + "/v1/batch";
+        headerBlock = std::make_shared<const segment::http::HeaderBlock>(headers);
+        commonHeaders = std::move(headers);
+
+        envelopeTail.clear();
+        if (Context.is_object()) {
+            envelopeTail += ",\"context\":";
+            AppendJSON(envelopeTail, Context);
+        }
         if (Integrations.is_object()) {
-            body["integrations"] = Integrations;
+            envelopeTail += ",\"integrations\":";
+            AppendJSON(envelopeTail, Integrations);
         }
-        if (Context.is_object()) {
-            body["context"] = Context;
+        envelopeTail += ",\"sentAt\":\"";
+        envelopeStale = false;
+    }
+
+    void Analytics::SetContext(Object context)
+    {
+        std::lock_guard<std::mutex> lk(this->lock);
+        Context = std::move(context);
+        envelopeStale = true;
+    }
+
+    void Analytics::SetIntegrations(Object integrations)
+    {
+        std::lock_guard<std::mutex> lk(this->lock);
+        Integrations = std::move(integrations);
+        envelopeStale = true;
+    }
+
+    // Render the request for a batch.  This is called with the lock held,
+    // since it reads Context and Integrations.
+    void Analytics::prepareBatch(const outgoing& b, segment::http::Request& req)
+    {
+        // The body is assembled from the already serialized events.  Only
+        // the envelope around them is rendered here.  We stamp the batch,
+        // and each event in it, with sentAt on each new attempt, since
+        // we're trying to synchronize our clock with the server's.  The
+        // events themselves are never changed: the stamp is written in
+        // front of each one's members, as it is copied into the body.
+        std::string sentAt;
+        appendTimeStamp(sentAt, std::chrono::system_clock::now());
+        std::string stamp = "{\"sentAt\":\"" + sentAt + "\"";
+        renderEnvelope();
+
+        // The body is built in a single allocation of the right size
+        // (b.size already counts the brackets and braces around the
+        // events), and then moved, never copied, all the way to the
+        // transport.
+        std::string body;
+        body.reserve(b.size + envelopeTail.size() + sentAt.size() + 2);
+        body += "{\"batch\":[";
+        for (auto const& q : b.events) {
+            if (&q != &b.events.front()) {
+                body += ',';
+            }
+            if (q.asIs) {
+                // Posted with a sentAt of its own; leave it be.
+                body += q.data;
+            } else if (q.data == "{}") {
+                body += stamp;
+                body += '}';
+            } else {
+                body += stamp;
+                body += ',';
+                body.append(q.data, 1, std::string::npos);
+            }
         }
+        body += ']';
+        body += envelopeTail;
+        body += sentAt;
+        body += "\"}";
 
         req.Method = "POST";
-        req.URL = this->host + "/v1/batch";
+        req.URL = batchURL;
+        if (Handler->SharesHeaders()) {
+            req.Common = headerBlock;
+        } else {
+            req.Headers = commonHeaders;
+        }
+        req.Body = std::move(body);
+    }
 
-        // Send user agent in the form of {library_name}/{library_version} as per RFC 7231.
-        auto library = this->Context["library"];
-        std::ostringstream ss;
-        ss << library["name"] << "/" << library["version"];
-        auto userAgent = ss.str();
-		userAgent.erase(std::remove(userAgent.begin(), userAgent.end(), '"'), userAgent.end());
-		req.Headers["User-Agent"] = userAgent;
+    // Retry-After is trusted at most this far, so that nothing it says
+    // can overflow the clock.  (The worker caps it further, at the retry
+    // policy's MaxDelay.)
+    static const std::chrono::seconds maxRetryAfter(3600);
 
-        // Note: libcurl could do this for us, but for other transports
-        // we do it here -- keeping the transports as unaware as possible.
-        req.Headers["Authorization"] = "Basic " + base64_encode(this->writeKey + ":");
-        req.Headers["Content-Type"] = "application/json";
-        req.Headers["Accept"] = "application/json";
-        req.Body = body.dump();
+    // When a response asks us to come back later, in either of the forms
+    // Retry-After may take: a number of seconds, or an HTTP date.
+    static std::chrono::steady_clock::time_point retryAfter(const segment::http::Response& resp)
+    {
+        for (auto const& h : resp.Headers) {
+            if ((h.first.size() != 11) || !std::equal(h.first.begin(), h.first.end(), "retry-after",
+                    [](char a, char b) { return std::tolower((unsigned char)a) == b; })) {
+                continue;
+            }
+            auto now = std::chrono::steady_clock::now();
+            char* end;
+            long secs = std::strtol(h.second.c_str(), &end, 10);
+            if ((end != h.second.c_str()) && (*end == '\0')) {
+                return now + std::chrono::seconds(std::min(std::max(secs, 0L), long(maxRetryAfter.count())));
+            }
+            std::istringstream in(h.second);
+            date::sys_seconds when;
+            in >> date::parse("%a, %d %b %Y %H:%M:%S", when);
+            if (!in.fail()) {
+                // In whole seconds, which cannot overflow for any date.
+                auto delay = when - date::floor<std::chrono::seconds>(std::chrono::system_clock::now());
+                if (delay.count() > 0) {
+                    return now + std::min(delay, maxRetryAfter);
+                }
+            }
+            return now;
+        }
+        return std::chrono::steady_clock::time_point::min();
+    }
+
+    // Record the outcome of an attempt to send a batch.  This is called
+    // without the lock, from a sender thread or a handler's completion.
+    void Analytics::settleBatch(outgoing& b,
+        std::unique_ptr<segment::http::Response> resp, std::exception_ptr err)
+    {
+        b.status = 0;
+        b.retryAfter = timePoint::min();
+        try {
+            if (err != nullptr) {
+                std::rethrow_exception(err);
+            }
+            b.status = resp->Code;
+            if (resp->Code != 200) {
+                b.retryAfter = retryAfter(*resp);
+                throw(segment::http::Error(resp->Code));
+            }
+            b.ok = true;
+        } catch (segment::http::Error& e) {
+            b.ok = false;
+            b.status = e.code;
+            b.reason = e.what();
+        } catch (std::exception& e) {
+            b.ok = false;
+            b.reason = e.what();
+        }
+    }
+
+    // How full the queue would be with this many events and bytes, as a
+    // fraction of whichever budget is nearer to being exhausted.
+    double Analytics::fullness(size_t count, size_t bytes)
+    {
+        double f = 0;
+        if (MaxQueuedEvents != 0) {
+            f = double(count) / MaxQueuedEvents;
+        }
+        if ((MaxQueuedBytes != 0) && (double(bytes) / MaxQueuedBytes > f)) {
+            f = double(bytes) / MaxQueuedBytes;
+        }
+        return f;
+    }
+
+    // Try to reserve room in the budget for an event of this size.  This
+    // reserves nothing, and returns false, if the event does not fit.
+    bool Analytics::reserve(size_t size)
+    {
+        auto count = queuedEvents.fetch_add(1) + 1;
+        auto bytes = queuedBytes.fetch_add(size) + size;
+        if (fullness(count, bytes) <= 1.0) {
+            return true;
+        }
+        queuedEvents -= 1;
+        queuedBytes -= size;
+        return false;
+    }
 
-        auto resp = this->Handler->Handle(req);
-        if (resp->Code != 200) {
-            throw(segment::http::Error(resp->Code));
+    // Return room to the budget, and let any blocked producers know.
+    // Called with the lock held.
+    void Analytics::release(size_t count, size_t bytes)
+    {
+        queuedEvents -= count;
+        queuedBytes -= bytes;
+        if (blocked > 0) {
+            spaceCv.notify_all();
         }
     }
 
-    void Analytics::queueEvent(Event ev)
+    void Analytics::queueEvent(const Event& ev)
+    {
+        // Serialize the event here, on the caller's thread.  This is the
+        // only time it is serialized, and the tree is freed right away.
+        queueData(ToJSON(ev), !ev.is_object() || (ev.find("sentAt") != ev.end()));
+    }
+
+    // Queue an event that has already been serialized.  Track and the
+    // like come straight here, without building a tree at all; they never
+    // write a sentAt, so their events are always stamped.
+    void Analytics::queueData(std::string data, bool asIs)
     {
-        std::lock_guard<std::mutex> lk(lock);
-        events.push_back(std::move(ev));
-        if (events.size() == 1) {
-            flushTime = std::chrono::system_clock::now() + FlushInterval;
-            if (flushTime < wakeTime) {
-                wakeTime = flushTime;
+        queued q;
+        q.data = std::move(data);
+        q.asIs = asIs;
+        auto size = q.data.size();
+        bool ok = true;
+
+        switch (Overflow) {
+        case OverflowPolicy::DropOldest:
+            // Always accept; the worker makes room by dropping from the
+            // front of the queue.
+            queuedEvents++;
+            queuedBytes += size;
+            break;
+
+        case OverflowPolicy::Sample: {
+            static thread_local std::minstd_rand rng(std::random_device{}());
+            auto f = fullness(queuedEvents + 1, queuedBytes + size);
+            if (f > 0.5) {
+                // Keep with probability 2 * (1 - f): one at half full,
+                // falling to zero when full.
+                std::uniform_real_distribution<double> coin(0.5, 1.0);
+                ok = (coin(rng) > f) && reserve(size);
+            } else {
+                ok = reserve(size);
             }
+            if (!ok) {
+                droppedSampled++;
+            }
+            break;
+        }
+
+        case OverflowPolicy::Block:
+            if (!(ok = reserve(size))) {
+                auto deadline = std::chrono::steady_clock::now() + BlockTimeout;
+                std::unique_lock<std::mutex> lk(lock);
+                blocked++;
+                while (!(ok = reserve(size))) {
+                    if (spaceCv.wait_until(lk, deadline) == std::cv_status::timeout) {
+                        ok = reserve(size);
+                        break;
+                    }
+                }
+                blocked--;
+                if (!ok) {
+                    droppedTimeout++;
+                }
+            }
+            break;
+
+        default:
+            if (!(ok = reserve(size))) {
+                droppedNewest++;
+            }
+            break;
+        }
+
+        if (!ok) {
+            auto cb = Callback;
+            if (cb != nullptr) {
+                try {
+                    cb->Failure(json::parse(q.data), "Queue full");
+                } catch (std::exception&) {
+                    // As with the worker, a failing callback changes nothing.
+                }
+            }
+            return;
+        }
+
+        incoming->push(std::move(q));
+
+        // Only the producer that finds the worker asleep needs to wake it;
+        // everyone else can leave without touching the lock.
+        if (sleeping.load() && sleeping.exchange(false)) {
+            std::lock_guard<std::mutex> lk(lock);
+            flushCv.notify_one();
+        }
+    }
+
+    // Drop the oldest events that have not yet been sent, until we are
+    // back within budget.  They are gathered into a failed batch, which
+    // the caller reports like any other.  Called with the lock held.
+    void Analytics::evictOldest(std::deque<std::unique_ptr<outgoing>>& finished)
+    {
+        std::unique_ptr<outgoing> b;
+        size_t count = 0;
+        size_t bytes = 0;
+        while (fullness(queuedEvents - count, queuedBytes - bytes) > 1.0) {
+            queued q;
+            if (!batch.empty()) {
+                q = std::move(batch.front());
+                batch.pop_front();
+                batchSize -= wireSize(q.data) + (batch.empty() ? 0 : 1);
+            } else if (!events.empty()) {
+                q = std::move(events.front());
+                events.pop_front();
+            } else {
+                break;
+            }
+            if (b == nullptr) {
+                b.reset(new outgoing());
+                b->size = 0;
+                b->fails = 0;
+                b->depth = 0;
+                b->ok = false;
+                b->reason = "Queue full";
+            }
+            count++;
+            bytes += q.data.size();
+            b->events.push_back(std::move(q));
+        }
+        if (b != nullptr) {
+            droppedOldest += count;
+            outstanding++;
+            finished.push_back(std::move(b));
+        }
+    }
+
+    // Split a refused batch in halves, and queue both to be sent right
+    // away, in order.  Each half starts afresh with its own retries, and
+    // counts as a batch in flight.  Called by the worker, with the lock
+    // held.
+    void Analytics::splitBatch(std::unique_ptr<outgoing> b, timePoint now)
+    {
+        std::unique_ptr<outgoing> halves[2];
+        size_t half = b->events.size() / 2;
+        for (int i = 0; i < 2; i++) {
+            auto& h = halves[i];
+            h.reset(new outgoing());
+            h->size = emptyBatchSize;
+            h->fails = 0;
+            h->depth = b->depth + 1;
+            h->ok = false;
+            h->status = 0;
+            h->retryTime = now;
+            h->retryAfter = timePoint::min();
+            size_t count = (i == 0) ? half : b->events.size();
+            while ((!b->events.empty()) && (h->events.size() < count)) {
+                h->size += wireSize(b->events.front().data) + (h->events.empty() ? 0 : 1);
+                h->events.push_back(std::move(b->events.front()));
+                b->events.pop_front();
+            }
+            retrying->push(std::move(h));
+        }
+        splitBatches++;
+        outstanding++;
+    }
+
+    // How many events may wait in memory to be batched before we spill.
+    // While a batch is waiting to be retried, the endpoint is presumably
+    // down, and we only keep the next batch's worth.
+    size_t Analytics::spillLimit()
+    {
+        return retrying->empty() ? SpillThreshold : FlushCount;
+    }
+
+    // Move everything from the inbox to the events queue, or to the spool
+    // behind anything already there.  Called by the worker, with the lock
+    // held.
+    void Analytics::drainInbox()
+    {
+        queued q;
+        auto limit = spillLimit();
+        while (incoming->pop(q)) {
+            if ((spilled != nullptr) && ((!spilled->empty()) || (events.size() >= limit))) {
+                try {
+                    spilled->push(q);
+                    spilledEvents++;
+                    release(1, q.data.size());
+                    continue;
+                } catch (std::exception&) {
+                    // Out of disk, most likely.  Keep it in memory instead;
+                    // it may then be delivered ahead of older spilled events.
+                }
+            }
+            if (events.empty() && batch.empty()) {
+                flushTime = std::chrono::steady_clock::now() + FlushInterval;
+                if (flushTime < wakeTime) {
+                    wakeTime = flushTime;
+                }
+            }
+            events.push_back(std::move(q));
+        }
+    }
+
+    // If the limit has dropped (because a batch failed), spill the newest
+    // events beyond it.  This is only possible while the spool is empty;
+    // otherwise what we hold in memory is older than what is on disk.
+    void Analytics::spillExcess()
+    {
+        auto limit = spillLimit();
+        if ((spilled == nullptr) || (!spilled->empty()) || (events.size() <= limit)) {
+            return;
+        }
+        auto keep = events.size();
+        try {
+            for (keep = limit; keep < events.size(); keep++) {
+                spilled->push(events[keep]);
+                spilledEvents++;
+                release(1, events[keep].data.size());
+            }
+        } catch (std::exception&) {
+            // Keep the rest in memory.
+        }
+        events.erase(events.begin() + limit, events.begin() + keep);
+    }
+
+    // Read spilled events back into memory, once the endpoint is healthy
+    // and the in-memory queue has drained to half the limit.  We stop at
+    // half the memory budget, to leave producers room.
+    void Analytics::unspill()
+    {
+        auto limit = spillLimit();
+        if ((spilled == nullptr) || persisting || (!retrying->empty()) || (events.size() > limit / 2)) {
+            return;
+        }
+        queued q;
+        while ((events.size() < limit) && (fullness(queuedEvents, queuedBytes) < 0.5) && spilled->pop(q)) {
+            spilledEvents--;
+            queuedEvents++;
+            queuedBytes += q.data.size();
+            events.push_back(std::move(q));
+            // These have waited long enough already.
+            needFlush = true;
+        }
+    }
+
+    // Wait for a producer or an API call to wake us, or for the deadline.
+    // We announce that we are going to sleep before the final check of
+    // the inbox, so that a producer either sees the announcement, or we
+    // see its event.
+    void Analytics::sleepUntil(std::unique_lock<std::mutex>& lk,
+        timePoint when)
+    {
+        sleeping.store(true);
+        if (incoming->empty()) {
+            if (when == timePoint::max()) {
+                flushCv.wait(lk);
+            } else {
+                flushCv.wait_until(lk, when);
+            }
+        }
+        sleeping.store(false);
+    }
+
+    // True if there is nothing left to do.  Called with the lock held.
+    bool Analytics::idle()
+    {
+        return events.empty() && batch.empty() && incoming->empty() && (outstanding == 0) && ((spilled == nullptr) || persisting || spilled->empty());
+    }
+
+    // Cut the batch we have been assembling, and hand it to the senders.
+    // Called by the worker, with the lock held.
+    void Analytics::dispatchBatch(timePoint now)
+    {
+        auto b = std::unique_ptr<outgoing>(new outgoing());
+        b->events.swap(batch);
+        b->size = batchSize;
+        b->fails = 0;
+        b->depth = 0;
+        b->ok = false;
+        b->sentTime = now;
+        batchSize = emptyBatchSize;
+        limiter->started(now);
+
+        ready.push_back(std::move(b));
+        outstanding++;
+        startSender();
+        sendCv.notify_one();
+    }
+
+    // Senders are started lazily, so that an instance which never needs
+    // more than one does not pay for more.  With an asynchronous handler,
+    // one sender can keep every batch in flight.  Called with the lock
+    // held.
+    void Analytics::startSender()
+    {
+        size_t most = Handler->Async() ? 1 : MaxInFlight;
+        if ((idleSenders == 0) && (senders.size() < most)) {
+            senders.push_back(std::thread(sender, this));
         }
-        flushCv.notify_one();
     }
 
     void Analytics::processQueue()
     {
-        int fails = 0;
-        bool ok;
-        std::string reason;
-        std::deque<Event> notifyq;
+        std::deque<std::unique_ptr<outgoing>> finished;
         std::unique_lock<std::mutex> lk(this->lock);
 
+        // The worker never polls.  Each pass through this loop either makes
+        // progress, or sleeps until a producer, a sender, an API call, or
+        // a deadline wakes it.
         for (;;) {
-            // There is a little mystery here.  Without this sleep,
-            // the Win32 system seems to get stuck; perhaps there is
-            // a subtle bug in the handling of condition variables
-            // or locks in the C++ runtime or threading libraries.
-            // POSIX systems don't seem to need it, but 10 millis
-            // is no sweat.
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            drainInbox();
+            spillExcess();
+            unspill();
+            if (Overflow == OverflowPolicy::DropOldest) {
+                evictOldest(finished);
+            }
+            auto now = std::chrono::steady_clock::now();
+
+            // Sort out the batches that the senders have finished with.
+            // Each batch has its own count of failures.  A batch that
+            // will be retried keeps its slot, so with MaxInFlight of 1
+            // nothing can overtake it.  A batch refused for its content
+            // is split, to find the events to blame.
+            while (!done.empty()) {
+                auto b = std::move(done.front());
+                done.pop_front();
+                if (RetryInterval != retryInterval) {
+                    retryInterval = RetryInterval;
+                    Retry->BaseDelay = retryInterval;
+                }
+                auto retry = Retry;
+                if (b->retryAfter != timePoint::min()) {
+                    b->retryAfter = std::min(b->retryAfter, now + retry->MaxDelay);
+                }
+                limiter->finished(*b, now, AdaptiveRate);
+                auto kind = RetryPolicy::Classify(b->status);
+                if (b->ok) {
+                    finished.push_back(std::move(b));
+                } else if ((b->fails < MaxRetries) && retry->Retryable(kind)) {
+                    b->fails++;
+                    b->retryTime = std::max(now + retry->Backoff(b->fails), b->retryAfter);
+                    retrying->push(std::move(b));
+                } else if ((b->events.size() > 1) && (b->depth < MaxSplitDepth) && retry->Splittable(kind)) {
+                    splitBatch(std::move(b), now);
+                } else {
+                    if (b->depth > 0) {
+                        isolatedEvents += b->events.size();
+                    }
+                    finished.push_back(std::move(b));
+                }
+            }
 
-            if (events.empty() && batch.empty()) {
-                // Reset failure count so we start with a clean slate.
-                // Otherwise we could have a failure hours earlier that
-                // allows only one failed post hours later.
-                fails = 0;
-                wakeTime = std::chrono::time_point<std::chrono::system_clock>::max();
+            // Retries that are due go ahead of anything new, as the rate
+            // limit allows.
+            size_t pos = 0;
+            while (limiter->allows(now)) {
+                auto b = retrying->popDue(now);
+                if (b == nullptr) {
+                    break;
+                }
+                b->sentTime = now;
+                limiter->started(now);
+                ready.insert(ready.begin() + pos++, std::move(b));
+                sendCv.notify_one();
+            }
+
+            if (!finished.empty()) {
+                auto cb = Callback;
+                lk.unlock();
+
+                for (auto& b : finished) {
+                    for (auto& q : b->events) {
+                        try {
+                            if (cb != nullptr) {
+                                // Callbacks get the event back as an object, as
+                                // it was sent rather than exactly as it was
+                                // posted; we only pay to rebuild it if someone
+                                // is listening.
+                                auto ev = json::parse(q.data);
+                                if (b->ok) {
+                                    cb->Success(ev);
+                                } else {
+                                    cb->Failure(ev, b->reason);
+                                }
+                            }
+                        } catch (std::exception&) {
+                            // User supplied callback code failed.  There isn't
+                            // really anything else we can do.  Muddle on.  This
+                            // prevents a failure there from silently causing
+                            // the processing thread to stop functioning.
+                        }
+                    }
+                }
+
+                lk.lock();
+                for (auto const& b : finished) {
+                    size_t bytes = 0;
+                    for (auto const& q : b->events) {
+                        bytes += q.data.size();
+                    }
+                    release(b->events.size(), bytes);
+                }
+                outstanding -= finished.size();
+                finished.clear();
+                continue;
+            }
+
+            if (idle()) {
+                wakeTime = timePoint::max();
+                needFlush = false;
 
                 // We might have a flusher waiting
                 emptyCv.notify_all();
@@ -534,104 +2537,178 @@ namespace analytics {
                 // a shutdown without draining, just clear the queue
                 // independently.
                 if (shutdown) {
-                    return;
+                    break;
                 }
 
-                flushCv.wait(lk);
+                sleepUntil(lk, wakeTime);
                 continue;
             }
 
             // Gather up new items into the batch, assuming that the batch
-            // is not already full.
+            // is not already full.  We keep a running total of the size
+            // the batch will have when serialized, so each event is only
+            // accounted for once.
+            size_t limit = FlushSize;
+            if (FlushSizeCompressed && (Encoding != Compression::None)) {
+                // Estimate, from recent batches, how much raw data will
+                // compress down to FlushSize.
+                limit = size_t(FlushSize / compressRatio);
+            }
+            bool full = false;
             while ((!events.empty()) && (batch.size() < FlushCount)) {
-                json j;
-
-                // Try adding an event to the batch and checking the
-                // serialization...  This is pretty ineffecient as we
-                // serialize the objects multiple times, but it's easier
-                // to understand.  Later look at saving the last size,
-                // and only adding the size of the serialized event.
-
-                auto ev = events.front();
-                batch.push_back(ev);
-                j["batch"] = batch;
-                if (j.dump().size() >= FlushSize) {
-                    batch.pop_back(); // remove what we just added.
-                    needFlush = true;
+                auto& q = events.front();
+                auto size = batchSize + wireSize(q.data);
+                if (!batch.empty()) {
+                    size++; // separating comma
+                }
+                if ((size >= limit) && (!batch.empty())) {
+                    // Leave it for the next batch.  (An event too large
+                    // to fit even on its own is sent alone, rather than
+                    // wedging the queue forever.)
+                    full = true;
                     break;
                 }
-                // We inclucded this event, so remove it from the queue
-                // (it is already inthe batch.)
+                batchSize = size;
+                batch.push_back(std::move(q));
                 events.pop_front();
             }
 
             // We hit the limit.
             if (batch.size() >= FlushCount) {
-                needFlush = true;
+                full = true;
             }
 
-            auto now = std::chrono::system_clock::now();
-            auto tmstamp = date::format("%FT%TZ",
-                std::chrono::time_point_cast<std::chrono::milliseconds>(now));
-
-            if ((!needFlush) && (now < wakeTime)) {
-                flushCv.wait_until(lk, wakeTime);
+            if ((!batch.empty()) && (full || needFlush || (now >= wakeTime)) && (outstanding < MaxInFlight) && limiter->allows(now)) {
+                dispatchBatch(now);
+                // A flush covers everything queued, not just one batch.
+                if (events.empty()) {
+                    needFlush = false;
+                }
                 continue;
             }
 
-            // We're trying to flush, so clear our "need".
-            needFlush = false;
+            // Nothing more to do until an event arrives, a send completes,
+            // or a deadline passes.  If every slot is taken, only a
+            // completion (or a retry) can get us moving again.  Anything
+            // due to start must also wait for the rate limit.
+            auto deadline = retrying->next();
+            if ((!batch.empty()) && (outstanding < MaxInFlight)) {
+                deadline = std::min(deadline, (full || needFlush) ? now : wakeTime);
+            }
+            if (deadline != timePoint::max()) {
+                deadline = std::max(deadline, limiter->ready());
+            }
+            sleepUntil(lk, deadline);
+        }
 
-            try {
-                sendBatch();
-                ok = true;
-                fails = false;
-            } catch (std::exception& e) {
-                if (fails < MaxRetries) {
-                    // Something bad happened.  Let's wait a bit and
-                    // try again later.  We return this even to the
-                    // front.
-                    fails++;
-                    retryTime = now + RetryInterval;
-                    if (retryTime < wakeTime) {
-                        wakeTime = retryTime;
-                    }
-                    flushCv.wait_until(lk, wakeTime);
+        // Stop the senders.  They have nothing left to do.
+        stopping = true;
+        sendCv.notify_all();
+        lk.unlock();
+        for (auto& t : senders) {
+            t.join();
+        }
+    }
+
+    // Each sender thread takes batches from ready, posts them, and hands
+    // them back to the worker through done.  There are at most MaxInFlight
+    // of these, or just one if the handler is asynchronous.
+    void Analytics::sendQueue()
+    {
+        std::unique_lock<std::mutex> lk(this->lock);
+
+        for (;;) {
+            while (ready.empty() && !warming && !stopping) {
+                idleSenders++;
+                sendCv.wait(lk);
+                idleSenders--;
+            }
+            if (warming && !stopping) {
+                // Batches that arrive meanwhile go to another sender, if
+                // there can be one; or they wait, and find the connection
+                // ready when they go.
+                warming = false;
+                try {
+                    renderEnvelope();
+                } catch (std::exception&) {
+                    // The first batch will fail the same way, and say why.
                     continue;
                 }
-                ok = false;
-                reason = e.what();
-                // We intentionally have chosen not to reset the failure
-                // count.  Which means if we wind up failing to send one
-                // event after maxtries, we only try each of the following
-                // one time, until either the queue is empty or we have
-                // a success.
+                auto url = batchURL;
+                auto handler = Handler;
+                lk.unlock();
+                try {
+                    handler->Prewarm(url);
+                } catch (std::exception&) {
+                }
+                lk.lock();
+                continue;
             }
-            auto cb = Callback;
-            notifyq = batch;
-            batch.clear();
+            if (ready.empty()) {
+                return;
+            }
+
+            auto b = std::move(ready.front());
+            ready.pop_front();
+            segment::http::Request req;
+            try {
+                prepareBatch(*b, req);
+            } catch (...) {
+                // Nothing can be sent; the batch fails like any other.
+                settleBatch(*b, nullptr, std::current_exception());
+                done.push_back(std::move(b));
+                flushCv.notify_one();
+                continue;
+            }
+            auto handler = Handler;
+            auto enc = Encoding;
+            auto level = CompressionLevel;
             lk.unlock();
 
-            while (!notifyq.empty()) {
-                auto ev = notifyq.front();
-                notifyq.pop_front();
+            // Compression is done here, so that it neither holds the lock
+            // nor stalls the worker.  If it fails for any reason, the body
+            // is simply sent as it is.
+            if (enc != Compression::None) {
+                auto raw = req.Body.size();
                 try {
-                    if (cb != nullptr) {
-                        if (ok) {
-                            cb->Success(ev);
-                        } else {
-                            cb->Failure(ev, reason);
-                        }
+                    if (compressBody(req, enc, level)) {
+                        lk.lock();
+                        compressRatio = 0.75 * compressRatio + 0.25 * double(req.Body.size()) / raw;
+                        lk.unlock();
                     }
                 } catch (std::exception&) {
-                    // User supplied callback code failed.  There isn't really
-                    // anything else we can do.  Muddle on.  This prevents a
-                    // failure there from silently causing the processing thread
-                    // to stop functioning.
                 }
             }
 
+            if (handler->Async()) {
+                // The handler lets us know when the batch is done; in the
+                // meantime this thread is free to start the next one.
+                auto bp = b.release();
+                handler->HandleAsync(std::move(req),
+                    [this, bp](std::unique_ptr<segment::http::Response> resp, std::exception_ptr err) {
+                        std::unique_ptr<outgoing> b(bp);
+                        settleBatch(*b, std::move(resp), err);
+
+                        std::lock_guard<std::mutex> l(this->lock);
+                        done.push_back(std::move(b));
+                        flushCv.notify_one();
+                    });
+                lk.lock();
+                continue;
+            }
+
+            std::unique_ptr<segment::http::Response> resp;
+            std::exception_ptr err;
+            try {
+                resp = handler->Handle(req);
+            } catch (...) {
+                err = std::current_exception();
+            }
+            settleBatch(*b, std::move(resp), err);
+
             lk.lock();
+            done.push_back(std::move(b));
+            flushCv.notify_one();
         }
     }
 
@@ -640,5 +2717,10 @@ namespace analytics {
         self->processQueue();
     }
 
+    void Analytics::sender(Analytics* self)
+    {
+        self->sendQueue();
+    }
+
 } // namespace analytics
 } // namespace segment
@@ -7,15 +7,21 @@
 // found online at https://opensource.org/licenses/MIT.
 //
 
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <exception>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <new>
 #include <queue>
 #include <string>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include "http.hpp"
@@ -27,10 +33,73 @@
 namespace segment {
 namespace analytics {
 
+    /// PoolAlloc and PoolFree take small blocks from, and give them back
+    /// to, pools kept by each thread, without locking.  A block may be
+    /// freed by any thread; it joins that thread's pool.  A thread's pool
+    /// is handed to a common one when the thread exits.  Memory taken by
+    /// the pools is kept for reuse, and never returned to the heap.
+    /// Blocks larger than 256 bytes come straight from the heap.
+    void* PoolAlloc(size_t bytes);
+    void PoolFree(void* p, size_t bytes);
+
+    /// PoolAllocator is a standard allocator that uses PoolAlloc.  It can
+    /// serve as the AllocatorType of a nlohmann::basic_json, whose objects,
+    /// arrays and their nodes are then pooled (strings are not).
+    template <typename T>
+    class PoolAllocator {
+    public:
+        typedef T value_type;
+        typedef T* pointer;
+        typedef const T* const_pointer;
+        typedef T& reference;
+        typedef const T& const_reference;
+        typedef size_t size_type;
+        typedef std::ptrdiff_t difference_type;
+        template <typename U>
+        struct rebind {
+            typedef PoolAllocator<U> other;
+        };
+
+        PoolAllocator() {}
+        template <typename U>
+        PoolAllocator(const PoolAllocator<U>&)
+        {
+        }
+
+        T* allocate(size_t n) { return static_cast<T*>(PoolAlloc(n * sizeof(T))); }
+        void deallocate(T* p, size_t n) { PoolFree(p, n * sizeof(T)); }
+        size_t max_size() const { return size_t(-1) / sizeof(T); }
+
+        template <typename U, typename... Args>
+        void construct(U* p, Args&&... args)
+        {
+            ::new ((void*)p) U(std::forward<Args>(args)...);
+        }
+        template <typename U>
+        void destroy(U* p)
+        {
+            p->~U();
+        }
+    };
+
+    template <typename T, typename U>
+    bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) { return true; }
+    template <typename T, typename U>
+    bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) { return false; }
+
     /// Object represents a JSON object.  It supports very flexible
     /// map style operations, etc.  In the places where this is used
     /// we validate the entity is actually an Object.
+    ///
+    /// When built with SEGMENT_POOL_JSON (the POOL_JSON option in CMake),
+    /// Objects allocate from the pools of PoolAllocator rather than the
+    /// heap.  Everything that uses this header must then be built with it.
+#ifdef SEGMENT_POOL_JSON
+    using Object = nlohmann::basic_json<std::map, std::vector, std::string, bool,
+        std::int64_t, std::uint64_t, double, PoolAllocator>;
+#else
     using Object = nlohmann::json;
+#endif
 
     // Events are just JSON objects under the hood.
     using Event = Object;
@@ -52,13 +121,98 @@ namespace analytics {
 #endif
 
     /// TimeStamp is a convenience function that returns the current system
-    /// time in ISO-8601 format.  It will include fractional times to the
-    /// precision of the system clock.
+    /// time in ISO-8601 format, in UTC, to the millisecond; for example
+    /// "2017-06-01T17:23:45.678Z".
     std::string TimeStamp();
 
+    /// TimeStamp formats the given time just as above.  Each thread keeps
+    /// the date and time to the second that it last formatted, so only the
+    /// milliseconds are usually written afresh.
+    std::string TimeStamp(std::chrono::system_clock::time_point when);
+
+    /// ToJSON returns value as JSON text, byte for byte as value.dump()
+    /// would, but written straight into a string rather than through a
+    /// stream.  Where SSE2 is available, strings are scanned for the
+    /// characters that need escapes sixteen bytes at a time.
+    std::string ToJSON(const Object& value);
+
+    /// AppendJSON appends the text that ToJSON would return to out.
+    void AppendJSON(std::string& out, const Object& value);
+
+    /// Symbol is an interned string, for the event names and property keys
+    /// that a program uses over and over.  Making a Symbol looks its string
+    /// up in a table shared by the whole process, adding it (for good) if
+    /// it is new, and renders it as JSON just that once.  Copying and
+    /// comparing Symbols costs no more than it does for a pointer.  Making
+    /// one takes a lock, so keep them for reuse (as statics, say) rather
+    /// than making them afresh for each event; this is why a string never
+    /// becomes a Symbol without saying so.
+    class Symbol {
+    public:
+        explicit Symbol(const char* s);
+        explicit Symbol(const std::string& s);
+
+        /// str returns the string itself.
+        const std::string& str() const;
+
+        /// quoted returns the string as a JSON string: quoted, and escaped.
+        const std::string& quoted() const;
+
+        bool operator==(const Symbol& other) const { return e == other.e; }
+        bool operator!=(const Symbol& other) const { return e != other.e; }
+
+    private:
+        friend class Properties;
+        struct entry;
+        static const entry* intern(const std::string& s);
+        const entry* e;
+    };
+
+    /// Properties builds a properties object as JSON text, rather than as
+    /// a tree: setting a member appends it, key and value, to the text,
+    /// with nothing inserted into a map and no key copied.  Members are
+    /// written in the order they are set; each key should be set once.
+    class Properties {
+    public:
+        Properties();
+
+        Properties& Set(const Symbol& key, const std::string& value);
+        Properties& Set(const Symbol& key, const char* value);
+        Properties& Set(const Symbol& key, bool value);
+        Properties& Set(const Symbol& key, double value);
+        Properties& Set(const Symbol& key, const Properties& value);
+        Properties& Set(const Symbol& key, const Object& value);
+
+        template <typename T>
+        typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, Properties&>::type
+        Set(const Symbol& key, T value)
+        {
+            return std::is_signed<T>::value ? setInteger(key, (long long)value)
+                                            : setUnsigned(key, (unsigned long long)value);
+        }
+
+        /// Dump returns the object as JSON text.
+        const std::string& Dump() const { return text; }
+
+        /// Empty is true if no member has been set.
+        bool Empty() const { return text.size() == 2; }
+
+    private:
+        Properties& setInteger(const Symbol& key, long long value);
+        Properties& setUnsigned(const Symbol& key, unsigned long long value);
+        void addKey(const Symbol& key);
+        std::string text;
+    };
+
     /// Callback is the base class for analytics event callbacks.
     /// This should be subclassed, and an instance stored in the Analytics
     /// object, if necessary.  The default implementation does nothing.
+    ///
+    /// Events are held as JSON text once posted, and the Event passed to
+    /// a callback is parsed back from that text.  It is what was sent, but
+    /// it may not compare equal to what was posted: floating point numbers
+    /// are written to 15 significant digits, so 0.1 + 0.2, for example,
+    /// comes back as 0.3.
     class Callback {
     public:
         virtual ~Callback(){};
@@ -72,6 +226,138 @@ namespace analytics {
         virtual void Failure(const Event& ev, const std::string& reason) = 0;
     };
 
+    /// OverflowPolicy selects what happens to a new event when the queue
+    /// already holds MaxQueuedEvents events, or MaxQueuedBytes bytes.
+    /// Every event dropped is counted in Metrics, and reported through
+    /// Callback::Failure with the reason "Queue full".
+    enum class OverflowPolicy {
+        /// Wait up to BlockTimeout for room, then drop the new event.
+        /// Never use this from within a Callback.
+        Block,
+        /// Drop the new event.  Its failure is reported on the posting
+        /// thread, before the posting call returns.
+        DropNewest,
+        /// Keep the new event, and drop the oldest events that have not
+        /// yet been handed to a sender.  Batches already being sent are
+        /// never dropped, so the budget can be exceeded by at most
+        /// MaxInFlight batches.
+        DropOldest,
+        /// Once the queue is half full, keep new events with a probability
+        /// that falls from one to zero as the queue fills.  Failures are
+        /// reported on the posting thread.
+        Sample,
+    };
+
+    /// Compression selects the Content-Encoding of batch bodies.  Event
+    /// payloads are repetitive JSON, and typically compress several times
+    /// over.  Compression needs zlib; without it, bodies are always sent
+    /// as they are.
+    enum class Compression {
+        /// Send bodies uncompressed.  This is the default.
+        None,
+        /// Content-Encoding: gzip.
+        Gzip,
+        /// Content-Encoding: deflate (zlib format, per RFC 7230).
+        Deflate,
+    };
+
+    /// FailureKind classifies the ways in which a batch can fail.
+    enum class FailureKind {
+        /// No response: the server could not be reached, the connection
+        /// failed, or the request timed out (including 408).
+        Network,
+        /// 429 Too Many Requests.
+        Throttled,
+        /// 400 Bad Request: something in the batch is malformed.
+        Malformed,
+        /// 413 Payload Too Large.
+        TooLarge,
+        /// Any other 4xx status: the server will not accept the batch.
+        Client,
+        /// A 5xx status.
+        Server,
+        /// Any other status (redirects, for example).
+        Other,
+    };
+
+    /// RetryPolicy decides which failed batches are worth trying again,
+    /// and how long to wait before each retry.  The default retries
+    /// network failures, 429s and 5xx statuses with exponential backoff
+    /// and "full jitter": the wait before retry n is chosen at random
+    /// between zero and BaseDelay * 2^(n-1), capped at MaxDelay, so that
+    /// many clients failing together do not all retry together.  Other
+    /// failures are reported right away.  Subclass it to change either
+    /// decision.  A Retry-After from the server always takes precedence
+    /// over a shorter delay, though it too is capped at MaxDelay.
+    class RetryPolicy {
+    public:
+        RetryPolicy();
+        virtual ~RetryPolicy(){};
+
+        /// Classify returns the kind of failure that a status represents.
+        /// @param status [in] The HTTP status, or zero if there was none.
+        static FailureKind Classify(int status);
+
+        /// Retryable reports whether a failure of this kind is worth
+        /// trying again.
+        virtual bool Retryable(FailureKind kind) const;
+
+        /// Splittable reports whether a batch refused in this way should
+        /// be split in halves, and each half sent on its own, so that the
+        /// events to blame can be told apart from the rest.  The default
+        /// splits on Malformed and TooLarge.  See Analytics::MaxSplitDepth.
+        virtual bool Splittable(FailureKind kind) const;
+
+        /// Backoff returns how long to wait before a retry.
+        /// @param retry [in] Which retry this is, starting from one.
+        virtual std::chrono::milliseconds Backoff(int retry) const;
+
+        /// BaseDelay is the longest wait before the first retry.  The
+        /// default is one second.
+        std::chrono::milliseconds BaseDelay;
+
+        /// MaxDelay caps the wait before any retry, and the hold that a
+        /// Retry-After puts on sending.  The default is thirty seconds.
+        std::chrono::milliseconds MaxDelay;
+
+        /// Jitter randomizes each wait, between zero and its full length.
+        /// Without it, waits are exactly BaseDelay, doubling each time.
+        /// Defaults to true.
+        bool Jitter;
+    };
+
+    /// Metrics is a snapshot of the counters kept by an Analytics object.
+    struct Metrics {
+        /// Events (and their serialized bytes) accepted, but not yet
+        /// delivered or failed.
+        size_t QueuedEvents;
+        size_t QueuedBytes;
+
+        /// Events dropped because the queue was full, by policy.
+        uint64_t DroppedNewest;
+        uint64_t DroppedOldest;
+        uint64_t DroppedSampled;
+        /// Events dropped by OverflowPolicy::Block after BlockTimeout.
+        uint64_t DroppedTimeout;
+
+        /// Events currently spilled to disk.  See Analytics::EnableSpill.
+        size_t SpilledEvents;
+
+        /// SendRate is the most batches per second the client currently
+        /// allows itself to start, or zero if it is not limiting itself.
+        /// See Analytics::AdaptiveRate.
+        double SendRate;
+
+        /// Throttled counts responses of 429 Too Many Requests.
+        uint64_t Throttled;
+
+        /// SplitBatches counts refused batches that were split in halves,
+        /// and IsolatedEvents counts events that still failed after their
+        /// batch was split.  See Analytics::MaxSplitDepth.
+        uint64_t SplitBatches;
+        uint64_t IsolatedEvents;
+    };
+
     /// Analytics is the main object for accessing Segment's Analytics
     /// services; think of it as a handle or client object used to talk
     /// to Segment's servers.
@@ -87,18 +373,54 @@ namespace analytics {
         /// an error occurs.
         void Flush();
 
-        /// FlushWait flushes the queue, and waits for it to empty.  This
+        /// FlushWait flushes the queue, and waits for it to empty, and for
+        /// every outstanding batch to be delivered (or to fail).  This
         /// should be called upon program exit; the destructor calls it
         /// automatically.  This can mean that it may take some time
         /// to destroy this object.
         void FlushWait();
 
+        /// Prewarm gets the Handler ready to send, in the background, so
+        /// that the first batch does not have to wait for the server to be
+        /// looked up and connected to; see Handler::Prewarm.  It returns at
+        /// once.  Call it just after setting Handler, and any options that
+        /// the handler needs, in programs whose first flush is sensitive
+        /// to latency.
+        void Prewarm();
+
         /// Scrub deletes all events that are queued for processing.
         /// If an immediate exit is required, call this first.  This
         /// method should be called with caution, as it generally will
         /// lead to lost events.
         void Scrub();
 
+        /// GetMetrics returns the current values of the counters.
+        Metrics GetMetrics();
+
+        /// EnableSpill lets the queue overflow to append-only segment
+        /// files in the given directory, which must already exist, and must
+        /// not be shared with another Analytics object.  Events left there
+        /// by an earlier run are queued for delivery behind anything already
+        /// queued in memory.  Spilling is not available on Windows, and
+        /// failure to use the directory is reported by throwing
+        /// std::system_error.
+        ///
+        /// Once enabled, events beyond SpillThreshold that are waiting to
+        /// be batched go to disk, as do all but a batch worth of them while
+        /// a batch is waiting to be retried.  They are read back, in order,
+        /// as the queue drains.  Spilled events do not count against
+        /// MaxQueuedEvents or MaxQueuedBytes.  Scrub does not remove them,
+        /// and the destructor leaves them on disk for the next run; an
+        /// explicit FlushWait delivers them.
+        void EnableSpill(const std::string& directory);
+
+        /// SpillThreshold is how many events may wait in memory to be
+        /// batched before new ones are spilled.
+        size_t SpillThreshold;
+
+        /// SpillSegmentSize is the size of each segment file, in bytes.
+        size_t SpillSegmentSize;
+
         /// Handler is the backend HTTP transport handler.  The constructor
         /// will initialize a default based upon compile time operations.
         std::shared_ptr<segment::http::Handler> Handler;
@@ -110,9 +432,29 @@ namespace analytics {
 
         /// MaxRetries represents the maximum number of retries to perform
         /// posting an event, before giving up.  The failure will not be
-        /// reported until all retries are exhausted.
+        /// reported until all retries are exhausted, unless Retry says the
+        /// failure is not worth retrying.
         int MaxRetries;
 
+        /// Retry decides which failures to retry, and when.  It must not be
+        /// null.  See RetryPolicy.
+        std::shared_ptr<RetryPolicy> Retry;
+
+        /// RetryInterval is deprecated; set Retry->BaseDelay instead.  It
+        /// was the fixed wait before each retry.  Changing it now sets
+        /// Retry->BaseDelay to match, when the next failed batch is seen,
+        /// so retries start from it and back off as the policy says.
+        std::chrono::seconds RetryInterval;
+
+        /// MaxSplitDepth limits how many times a refused batch may be split
+        /// in halves, when Retry says the refusal is Splittable.  One bad
+        /// event then fails on its own, and the rest of its batch is still
+        /// delivered.  The default of 8 can narrow a batch of 256 events
+        /// down to one; zero fails the whole batch, as it is.  The halves
+        /// of a batch share its slot, so they are never overtaken, but for
+        /// a while more than MaxInFlight batches may be in flight.
+        int MaxSplitDepth;
+
         /// FlushCount is the maximum number of messages to hold before flushing.
         /// Changing this value is not recommended.
         size_t FlushCount;
@@ -130,26 +472,93 @@ namespace analytics {
         /// object is destroyed.)
         std::chrono::seconds FlushInterval;
 
-        /// The amount of time to wait before retrying a post.
-        std::chrono::seconds RetryInterval;
+        /// MaxInFlight is the number of batches that may be outstanding at
+        /// once.  A batch is outstanding from the time it is cut from the
+        /// queue until it has been delivered, or has failed for good; a
+        /// batch that is waiting to be retried still holds its slot.
+        /// With the default of 1, batches are delivered strictly in the
+        /// order events were posted.  With a larger value, batches are
+        /// started in order, but may complete (and be retried) in any
+        /// order; only the order of events within a batch is preserved.
+        /// Each batch gets its own MaxRetries attempts.  A synchronous
+        /// Handler needs a thread per batch in flight; an asynchronous one
+        /// (such as HandlerCurlMulti) keeps them all going from one thread,
+        /// so this can be set much higher.
+        size_t MaxInFlight;
+
+        /// MaxQueuedEvents and MaxQueuedBytes bound the memory used by
+        /// events that have been posted but not yet delivered, including
+        /// those in batches being sent.  Bytes are counted in serialized
+        /// form.  Zero, the default for both, means no limit.
+        size_t MaxQueuedEvents;
+        size_t MaxQueuedBytes;
+
+        /// Overflow is what to do with events that would exceed the limits
+        /// above.  The default is OverflowPolicy::DropNewest.
+        OverflowPolicy Overflow;
+
+        /// BlockTimeout is how long OverflowPolicy::Block waits for room.
+        std::chrono::milliseconds BlockTimeout;
+
+        /// AdaptiveRate lets the client slow down when the server pushes
+        /// back.  Once a batch is refused with 429 or a 5xx status, the
+        /// rate at which batches start is halved (from the rate seen so
+        /// far); every delivered batch then raises it a little, so that it
+        /// climbs back by about one batch per second, each second.  The
+        /// current limit is reported in Metrics::SendRate.  A Retry-After
+        /// header is always honored: nothing is sent until it has passed.
+        /// Defaults to true.
+        bool AdaptiveRate;
+
+        /// Encoding is the compression applied to batch bodies.  Bodies
+        /// are compressed on the sender threads, not the worker.
+        Compression Encoding;
+
+        /// CompressionLevel trades CPU for size, from 1 (fastest) to 9
+        /// (smallest).  The default is 6.
+        int CompressionLevel;
+
+        /// FlushSizeCompressed applies FlushSize to the compressed body,
+        /// rather than the raw one.  Since a batch must be cut before it is
+        /// compressed, its compressed size is estimated from that of recent
+        /// batches.  Segment limits the size of the raw body, so only set
+        /// this for an endpoint that limits the bytes on the wire.
+        bool FlushSizeCompressed;
 
         /// Default context. We populate a default context with the
         /// library and operating system.  This will be merged against
         /// any other more detail context you might wish to set.
+        /// It is rendered once, when the first batch is sent; to change
+        /// it after that, use SetContext.
         Object Context;
 
         /// Default integrations. This must be a dictionary of string
         /// keys to booleans.  (A JSON object where all values are booleans.)
+        /// As with Context, change it with SetIntegrations once events
+        /// are being sent.
         Object Integrations;
 
+        /// SetContext replaces the default context.  Batches sent from
+        /// then on carry the new one (and a User-Agent to match).
+        void SetContext(Object context);
+
+        /// SetIntegrations replaces the default integrations, for the
+        /// batches sent from then on.
+        void SetIntegrations(Object integrations);
+
         // With each of these functions, if you need to use an anonymous ID
         // instead of a user ID, just pass the empty string for the user ID
-        // and set the anonymous ID after.
+        // and set the anonymous ID after.  Properties and traits passed as
+        // rvalues are moved into the event; otherwise they are copied.
 
         Event CreateTrackEvent(
             const std::string& event,
             const std::string& userId,
             const Object& properties = nullptr);
+        Event CreateTrackEvent(
+            const std::string& event,
+            const std::string& userId,
+            Object&& properties);
 
         Event CreateAliasEvent(
             const std::string& previousId,
@@ -158,33 +567,61 @@ namespace analytics {
         Event CreateIdentifyEvent(
             const std::string& userId,
             const Object& traits = nullptr);
+        Event CreateIdentifyEvent(
+            const std::string& userId,
+            Object&& traits);
 
         Event CreateGroupEvent(
             const std::string& groupId,
             const Object& traits);
+        Event CreateGroupEvent(
+            const std::string& groupId,
+            Object&& traits);
 
         Event CreatePageEvent(
             const std::string& name,
             const std::string& userId,
             const Object& properties = nullptr);
+        Event CreatePageEvent(
+            const std::string& name,
+            const std::string& userId,
+            Object&& properties);
 
         Event CreateScreenEvent(
             const std::string& name,
             const std::string& userId,
             const Object& properties = nullptr);
+        Event CreateScreenEvent(
+            const std::string& name,
+            const std::string& userId,
+            Object&& properties);
 
         void SetEventAnonymousId(Event&, const std::string&);
         void SetEventIntegrations(Event&, const Object&);
         void SetEventContext(Event&, const Object&);
         void SetEventTimeStamp(Event&, const std::string&);
 
-        void PostEvent(Event);
+        /// PostEvent queues an event built by the caller.  The event is
+        /// serialized before this returns, and never copied; passed as an
+        /// rvalue, its tree is also freed before this returns.  Track and
+        /// the rest never copy what they are given either (nor build a
+        /// tree at all), so there is no need to move anything into them.
+        void PostEvent(const Event&);
+        void PostEvent(Event&&);
 
         void Track(
             const std::string& userId,
             const std::string& event,
             const Object& properties = nullptr);
 
+        /// Track with an interned event name and built properties writes
+        /// both as they already are: the name as it was rendered when it
+        /// was interned, and the properties without a tree.
+        void Track(
+            const std::string& userId,
+            const Symbol& event,
+            const Properties& properties);
+
         void Track(
             const std::string& userId,
             const std::string& anonymousId,
@@ -260,19 +697,116 @@ namespace analytics {
         std::condition_variable emptyCv;
         std::condition_variable flushCv;
         std::thread thr;
-        std::deque<Event> events;
-        std::deque<Event> batch;
-        std::chrono::system_clock::time_point flushTime;
-        std::chrono::system_clock::time_point retryTime;
-        std::chrono::system_clock::time_point wakeTime;
+
+        // queued is an event waiting to be sent, in its compact serialized
+        // form.  Events are serialized exactly once, on the thread that
+        // posts them; the worker only ever concatenates the bytes.
+        struct queued {
+            std::string data;
+            bool asIs; // has a sentAt of its own, or is not an object
+        };
+        struct envelope;
+        std::deque<queued> events;
+        std::deque<queued> batch;
+        size_t batchSize; // serialized size of {"batch":[...]} so far
+        double compressRatio; // recent compressed size / raw size
+
+        // Producers hand events to the worker through a lock-free inbox,
+        // and only signal flushCv when the worker says it is asleep.
+        class inbox;
+        std::unique_ptr<inbox> incoming;
+        std::atomic<bool> sleeping;
+        // All scheduling is done against the monotonic clock, so that
+        // changes to the wall clock cannot stall or race the worker.
+        using timePoint = std::chrono::steady_clock::time_point;
+        timePoint flushTime;
+        timePoint wakeTime;
+
+        // outgoing is a batch that has been cut from the queue.  It moves
+        // from ready, to a sender thread, to done; and from there either
+        // back to ready by way of retrying, or to the callbacks.
+        struct outgoing {
+            std::deque<queued> events;
+            size_t size;
+            int fails;
+            int depth; // times split since it was cut from the queue
+            timePoint retryTime;
+            timePoint sentTime; // start of the latest attempt
+            bool ok;
+            int status; // HTTP status of the latest attempt, or zero
+            timePoint retryAfter; // as asked by the server, if it did
+            std::string reason;
+        };
+        std::deque<std::unique_ptr<outgoing>> ready;
+        class retryQueue;
+        std::unique_ptr<retryQueue> retrying;
+        class rateLimiter;
+        std::unique_ptr<rateLimiter> limiter;
+
+        // Events spilled to disk, when enabled.  The spool always holds
+        // events newer than any in memory.
+        class spool;
+        std::unique_ptr<spool> spilled;
+        std::atomic<size_t> spilledEvents;
+        bool persisting; // shutting down; leave spilled events on disk
+        std::deque<std::unique_ptr<outgoing>> done;
+        size_t outstanding; // batches cut, but not yet finished
+        uint64_t splitBatches;
+        uint64_t isolatedEvents;
+        std::chrono::seconds retryInterval; // RetryInterval as last applied
+
+        // Budget accounting.  These are updated without the lock.
+        std::atomic<size_t> queuedEvents;
+        std::atomic<size_t> queuedBytes;
+        std::atomic<uint64_t> droppedNewest;
+        std::atomic<uint64_t> droppedOldest;
+        std::atomic<uint64_t> droppedSampled;
+        std::atomic<uint64_t> droppedTimeout;
+        std::atomic<int> blocked; // producers waiting on spaceCv
+        std::condition_variable spaceCv;
+
+        std::condition_variable sendCv;
+        std::vector<std::thread> senders;
+        size_t idleSenders;
+        bool stopping;
+        bool warming; // a sender should call Handler->Prewarm
 
         bool needFlush;
         bool shutdown;
 
-        void sendBatch();
-        void queueEvent(Event);
+        // The parts of a batch request that are the same for every batch,
+        // rendered once and again only after SetContext or SetIntegrations:
+        // the headers, both as a block, for transports that take one, and
+        // as a map, for those that don't; and the body after the events,
+        // up to the sentAt value.
+        std::string batchURL;
+        std::map<std::string, std::string> commonHeaders;
+        std::shared_ptr<const segment::http::HeaderBlock> headerBlock;
+        std::string envelopeTail;
+        bool envelopeStale;
+
+        void renderEnvelope();
+        void prepareBatch(const outgoing&, segment::http::Request&);
+        void settleBatch(outgoing&, std::unique_ptr<segment::http::Response>, std::exception_ptr);
+        void queueEvent(const Event&);
+        void queueData(std::string, bool asIs = false);
+        double fullness(size_t, size_t);
+        bool reserve(size_t);
+        void release(size_t, size_t);
+        void evictOldest(std::deque<std::unique_ptr<outgoing>>&);
+        void splitBatch(std::unique_ptr<outgoing>, timePoint);
+        size_t spillLimit();
+        void spillExcess();
+        void unspill();
+        void drainInbox();
+        void sleepUntil(std::unique_lock<std::mutex>&, timePoint);
+        bool idle();
+        void dispatchBatch(timePoint);
+        void startSender();
         void processQueue();
+        void sendQueue();
         static void worker(Analytics*);
+        static void sender(Analytics*);
     };
 
 } // namespace analytics
@@ -0,0 +1,90 @@
+//
+// Copyright 2017 Segment Inc. <friends@segment.com>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// bench-batch measures the cost of assembling batches.  It compares the
+// original approach, which re-serialized the whole batch each time an
+// event was added, against Analytics itself, posting the same events
+// through a transport that does no I/O.
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "bench.hpp"
+
+using namespace bench;
+using json = nlohmann::json;
+
+static const size_t flushSize = 500 * 1024;
+
+// legacy is the batch assembly from earlier releases: quadratic.
+static size_t legacy(const std::vector<Event>& events, size_t count)
+{
+    std::deque<Event> batch;
+    size_t sent = 0;
+    for (auto const& ev : events) {
+        json j;
+        batch.push_back(ev);
+        j["batch"] = batch;
+        if ((j.dump().size() >= flushSize) || (batch.size() >= count)) {
+            sent += batch.size();
+            batch.clear();
+        }
+    }
+    return sent + batch.size();
+}
+
+// library posts the events through Analytics, and waits until every
+// batch has been handed to the transport.
+static size_t library(const std::vector<Event>& events, size_t count)
+{
+    auto cb = std::make_shared<Counter>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = std::make_shared<NullHandler>();
+    analytics.Callback = cb;
+    analytics.FlushCount = count;
+    analytics.FlushSize = flushSize;
+    analytics.FlushInterval = std::chrono::seconds(3600);
+
+    for (auto const& ev : events) {
+        analytics.Track(ev["userId"].get<std::string>(), ev["event"].get<std::string>(), ev["properties"]);
+    }
+    analytics.Flush();
+    cb->Wait(events.size());
+    return events.size();
+}
+
+int main()
+{
+    size_t sizes[] = { 1, 50, 250, 1000 };
+
+    std::printf("%-32s %6s %14s\n", "assembly", "batch", "rate");
+    for (auto count : sizes) {
+        std::vector<Event> events;
+        // Keep the quadratic case bounded in time.
+        size_t total = count * 4 < 2000 ? 2000 : count * 4;
+        for (size_t i = 0; i < total; i++) {
+            Event ev;
+            ev["type"] = "track";
+            ev["event"] = "Product Viewed";
+            ev["userId"] = "user" + std::to_string(i);
+            ev["properties"] = SampleProperties(int(i));
+            events.push_back(ev);
+        }
+
+        Stopwatch sw;
+        auto n = legacy(events, count);
+        Report("before (re-serialize batch)", count, n / sw.Seconds(), "events/s");
+
+        sw.Reset();
+        n = library(events, count);
+        Report("after (Analytics::Track)", count, n / sw.Seconds(), "events/s");
+    }
+    return 0;
+}
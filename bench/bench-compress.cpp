@@ -0,0 +1,115 @@
+//
+// Copyright 2017 Segment Inc. <friends@segment.com>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// bench-compress measures batch body compression: the ratio achieved on
+// typical batches, and the CPU it costs, at a few zlib levels.  It then
+// sends events through Analytics to a stand-in server on the loopback
+// interface, with and without compression, reporting throughput and
+// bytes on the wire per event.
+
+#include <ctime>
+#include <string>
+
+#include <zlib.h>
+
+#include "bench.hpp"
+#include "http-curl.hpp"
+#include "standin.hpp"
+
+using namespace bench;
+
+static std::string sampleBody(size_t count)
+{
+    std::string body = "{\"batch\":[";
+    for (size_t i = 0; i < count; i++) {
+        Event ev;
+        ev["type"] = "track";
+        ev["event"] = "Product Viewed";
+        ev["userId"] = "user" + std::to_string(i);
+        ev["timestamp"] = TimeStamp();
+        ev["properties"] = SampleProperties(int(i));
+        if (i != 0) {
+            body += ',';
+        }
+        body += ev.dump();
+    }
+    body += "],\"sentAt\":\"" + TimeStamp() + "\"}";
+    return body;
+}
+
+// gzip compresses the way Analytics does, returning the compressed size.
+static size_t gzip(const std::string& in, int level, std::string& out)
+{
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    out.resize(deflateBound(&zs, uLong(in.size())));
+    zs.next_in = (Bytef*)in.data();
+    zs.avail_in = uInt(in.size());
+    zs.next_out = (Bytef*)&out[0];
+    zs.avail_out = uInt(out.size());
+    deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    return zs.total_out;
+}
+
+static void library(const char* what, Compression enc, int level)
+{
+    const size_t total = 100000;
+    standin server(false);
+    auto cb = std::make_shared<Counter>();
+    {
+        Analytics analytics("writeKey", server.Host());
+        analytics.Handler = std::make_shared<segment::http::HandlerCurl>();
+        analytics.Callback = cb;
+        analytics.Encoding = enc;
+        analytics.CompressionLevel = level;
+        analytics.MaxInFlight = 4;
+
+        Stopwatch sw;
+        for (size_t i = 0; i < total; i++) {
+            analytics.Track("user" + std::to_string(i), "Product Viewed", SampleProperties(int(i)));
+        }
+        cb->Wait(total);
+        Report(what, 250, total / sw.Seconds(), "events/s");
+    }
+    Report(what, 250, double(server.Received) / total, "wire bytes/event");
+}
+
+int main()
+{
+    const int rounds = 200;
+    size_t sizes[] = { 50, 250 };
+    int levels[] = { 1, 6, 9 };
+
+    std::printf("%-32s %6s %14s\n", "gzip", "batch", "result");
+    for (auto count : sizes) {
+        auto body = sampleBody(count);
+        for (auto level : levels) {
+            std::string out;
+            size_t zsize = 0;
+            auto start = std::clock();
+            for (int i = 0; i < rounds; i++) {
+                zsize = gzip(body, level, out);
+            }
+            auto usec = double(std::clock() - start) * 1e6 / CLOCKS_PER_SEC / rounds;
+            auto label = "level " + std::to_string(level);
+            // Ratios are small numbers; Report would round them away.
+            std::printf("%-32s %6zu %14.1f x\n", (label + " ratio").c_str(), count, double(body.size()) / zsize);
+            Report((label + " CPU per batch").c_str(), count, usec, "usec");
+            Report((label + " CPU per MB").c_str(), count, usec * 1e6 / body.size(), "usec");
+        }
+    }
+
+    std::printf("\n%-32s %6s %14s\n", "end-to-end (loopback)", "batch", "rate");
+    library("uncompressed", Compression::None, 6);
+    library("gzip level 1", Compression::Gzip, 1);
+    library("gzip level 6", Compression::Gzip, 6);
+    return 0;
+}
@@ -0,0 +1,191 @@
+//
+// Copyright 2017 Segment Inc. <friends@segment.com>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// bench-curl measures the per-batch latency of HandlerCurl against a
+// stand-in for the Segment API on the loopback interface, with and
+// without connection reuse.  The stand-in accepts any POST, and answers
+// 200 with keep-alive.  When built with OpenSSL it is also run over
+// TLS, using a throwaway self-signed certificate, which is where reuse
+// matters most: a fresh connection costs a full handshake.
+//
+// It then measures the latency of the first flush of a new Analytics
+// object, with and without Prewarm; and throughput: HandlerCurlMulti
+// with many requests in flight from one thread, and Analytics end to
+// end with the threaded and the asynchronous transports.
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "http-curl.hpp"
+#include "standin.hpp"
+
+using namespace bench;
+
+static void run(const char* what, standin& server, bool reuse, const std::string& body)
+{
+    const int trials = 200;
+
+    segment::http::HandlerCurl handler;
+    handler.Reuse = reuse;
+    handler.CAInfo = server.CAFile;
+
+    segment::http::Request req;
+    req.Method = "POST";
+    req.URL = server.URL();
+    req.Headers["Content-Type"] = "application/json";
+    req.Headers["Authorization"] = "Basic d3JpdGVLZXk6";
+    req.Headers["User-Agent"] = "analytics-cpp/bench";
+    req.Body = body;
+
+    std::vector<double> usec;
+    for (int i = 0; i < trials; i++) {
+        Stopwatch sw;
+        handler.Handle(req);
+        usec.push_back(sw.Seconds() * 1e6);
+    }
+    std::sort(usec.begin(), usec.end());
+    std::string label = std::string(what) + (reuse ? " reuse" : " fresh");
+    Report((label + " p50").c_str(), body.size() / 1024, usec[usec.size() / 2], "usec");
+    Report((label + " p99").c_str(), body.size() / 1024, usec[usec.size() * 99 / 100], "usec");
+}
+
+// first times the first FlushWait of a new Analytics object, which
+// starts with no connection.  With prewarm, the connection is made while
+// the program goes about its startup (which we take to be 50ms).
+static void first(const char* what, standin& server, bool prewarm)
+{
+    const int trials = 20;
+
+    std::vector<double> usec;
+    for (int i = 0; i < trials; i++) {
+        auto handler = std::make_shared<segment::http::HandlerCurl>();
+        handler->CAInfo = server.CAFile;
+        Analytics analytics("writeKey", server.Host());
+        analytics.Handler = handler;
+        if (prewarm) {
+            analytics.Prewarm();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        analytics.Track("user", "Product Viewed", SampleProperties(i));
+        Stopwatch sw;
+        analytics.FlushWait();
+        usec.push_back(sw.Seconds() * 1e6);
+    }
+    std::sort(usec.begin(), usec.end());
+    std::string label = std::string(what) + (prewarm ? " prewarmed" : " cold");
+    Report((label + " p50").c_str(), 1, usec[usec.size() / 2], "usec");
+}
+
+// multi posts count requests through HandlerCurlMulti, keeping up to
+// flight of them going at once.
+static double multi(standin& server, size_t flight, const std::string& body, size_t count)
+{
+    segment::http::HandlerCurlMulti handler;
+    handler.MaxIdle = flight;
+
+    std::mutex lk;
+    std::condition_variable cv;
+    size_t started = 0, finished = 0;
+
+    Stopwatch sw;
+    std::unique_lock<std::mutex> l(lk);
+    while (finished < count) {
+        if ((started < count) && (started - finished < flight)) {
+            segment::http::Request req;
+            req.Method = "POST";
+            req.URL = server.URL();
+            req.Headers["Content-Type"] = "application/json";
+            req.Body = body;
+            started++;
+            l.unlock();
+            handler.HandleAsync(std::move(req), [&](std::unique_ptr<segment::http::Response>, std::exception_ptr) {
+                std::lock_guard<std::mutex> g(lk);
+                finished++;
+                cv.notify_all();
+            });
+            l.lock();
+            continue;
+        }
+        cv.wait(l);
+    }
+    return count / sw.Seconds();
+}
+
+// library sends events through Analytics to the stand-in.
+static double library(standin& server, std::shared_ptr<segment::http::Handler> handler, size_t flight, size_t total)
+{
+    auto cb = std::make_shared<Counter>();
+    Analytics analytics("writeKey", server.Host());
+    analytics.Handler = handler;
+    analytics.Callback = cb;
+    analytics.FlushCount = 250;
+    analytics.MaxInFlight = flight;
+
+    Stopwatch sw;
+    for (size_t i = 0; i < total; i++) {
+        analytics.Track("user" + std::to_string(i), "Product Viewed", SampleProperties(int(i)));
+    }
+    cb->Wait(total);
+    return total / sw.Seconds();
+}
+
+int main()
+{
+    size_t sizes[] = { 1024, 64 * 1024, 480 * 1024 };
+
+    std::printf("%-32s %6s %14s\n", "per-batch latency", "KiB", "time");
+    for (auto size : sizes) {
+        std::string body(size, 'x');
+        {
+            standin server(false);
+            run("http", server, false, body);
+            run("http", server, true, body);
+        }
+#ifdef BENCH_TLS
+        {
+            standin server(true);
+            run("https", server, false, body);
+            run("https", server, true, body);
+        }
+#endif
+    }
+
+    std::printf("\n%-32s %6s %14s\n", "first flush", "events", "time");
+    {
+        standin server(false);
+        first("http", server, false);
+        first("http", server, true);
+    }
+#ifdef BENCH_TLS
+    {
+        standin server(true);
+        first("https", server, false);
+        first("https", server, true);
+    }
+#endif
+
+    std::printf("\n%-32s %6s %14s\n", "throughput (64 KiB)", "flight", "rate");
+    {
+        standin server(false);
+        std::string body(64 * 1024, 'x');
+        size_t flights[] = { 1, 8, 64 };
+        for (auto flight : flights) {
+            Report("HandlerCurlMulti", flight, multi(server, flight, body, 2000), "requests/s");
+        }
+
+        const size_t total = 200000;
+        Report("Analytics + HandlerCurl", 8,
+            library(server, std::make_shared<segment::http::HandlerCurl>(), 8, total), "events/s");
+        Report("Analytics + HandlerCurlMulti", 64,
+            library(server, std::make_shared<segment::http::HandlerCurlMulti>(), 64, total), "events/s");
+    }
+    return 0;
+}
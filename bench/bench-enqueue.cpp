@@ -0,0 +1,124 @@
+//
+// Copyright 2017 Segment Inc. <friends@segment.com>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// bench-enqueue measures how quickly many threads can post events.
+// As a point of reference it also runs the same load through a plain
+// mutex-guarded deque that signals its consumer on every push, which
+// is how Analytics used to queue events.
+
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+
+using namespace bench;
+
+// reference is the old style queue: one lock, one wakeup per event.
+class reference {
+public:
+    reference()
+        : done(false)
+        , consumed(0)
+        , sizes(0)
+    {
+        thr = std::thread([this]() {
+            std::unique_lock<std::mutex> l(lk);
+            while (!done || !q.empty()) {
+                while (!q.empty()) {
+                    q.pop_front();
+                    consumed++;
+                }
+                if (!done) {
+                    cv.wait(l);
+                }
+            }
+        });
+    }
+    ~reference()
+    {
+        {
+            std::lock_guard<std::mutex> l(lk);
+            done = true;
+            cv.notify_one();
+        }
+        thr.join();
+    }
+    void Push(Event ev)
+    {
+        // Analytics measures each event as it is queued; so do we, to
+        // keep the comparison about the queue itself.
+        sizes += ev.dump().size();
+        std::lock_guard<std::mutex> l(lk);
+        q.push_back(std::move(ev));
+        cv.notify_one();
+    }
+
+private:
+    std::mutex lk;
+    std::condition_variable cv;
+    std::deque<Event> q;
+    std::thread thr;
+    bool done;
+    size_t consumed;
+    std::atomic<size_t> sizes;
+};
+
+template <typename F>
+static double run(int producers, size_t perThread, F post)
+{
+    std::vector<std::thread> threads;
+    Stopwatch sw;
+    for (int p = 0; p < producers; p++) {
+        threads.push_back(std::thread([&post, perThread, p]() {
+            for (size_t i = 0; i < perThread; i++) {
+                post(p, i);
+            }
+        }));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    return (producers * perThread) / sw.Seconds();
+}
+
+int main()
+{
+    const size_t total = 64 * 1024;
+    int counts[] = { 1, 2, 4, 8, 16, 32, 64 };
+    Event sample;
+    sample["type"] = "track";
+    sample["event"] = "Product Viewed";
+    sample["userId"] = "user";
+    sample["properties"] = SampleProperties(1);
+
+    std::printf("%-32s %6s %14s\n", "enqueue", "thrds", "rate");
+    for (auto producers : counts) {
+        size_t perThread = total / producers;
+        double rate;
+        {
+            reference ref;
+            rate = run(producers, perThread, [&](int, size_t) { ref.Push(sample); });
+        }
+        Report("mutex + deque (reference)", producers, rate, "events/s");
+
+        auto cb = std::make_shared<Counter>();
+        {
+            Analytics analytics("writeKey", "http://localhost");
+            analytics.Handler = std::make_shared<NullHandler>();
+            analytics.Callback = cb;
+            analytics.FlushCount = 250;
+            rate = run(producers, perThread, [&](int, size_t) { analytics.PostEvent(sample); });
+            cb->Wait(producers * perThread);
+        }
+        Report("Analytics::PostEvent", producers, rate, "events/s");
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+//
+// Copyright 2017 Segment Inc. <friends@segment.com>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// bench-event measures what it costs the caller to post an event: calls
+// per second, and heap allocations (count and bytes) per event on the
+// calling thread.  It compares building the event as a JSON tree and
+// posting that (as Track used to), against Track, which writes its
+// fixed fields straight to the wire format.  The properties object is
+// built once, up front, since the caller pays for it either way.
+
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include "bench.hpp"
+
+using namespace bench;
+
+// Count allocations made by each thread, so that the worker's share is
+// left out.
+static thread_local size_t allocCount;
+static thread_local size_t allocBytes;
+
+void* operator new(size_t n)
+{
+    allocCount++;
+    allocBytes += n;
+    void* p = std::malloc(n == 0 ? 1 : n);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+template <typename F>
+static void run(const char* what, size_t total, F post)
+{
+    auto cb = std::make_shared<Counter>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = std::make_shared<NullHandler>();
+    analytics.Callback = cb;
+    analytics.FlushCount = 250;
+
+    std::vector<std::string> users;
+    for (size_t i = 0; i < total; i++) {
+        users.push_back("user" + std::to_string(i));
+    }
+
+    allocCount = 0;
+    allocBytes = 0;
+    Stopwatch sw;
+    for (size_t i = 0; i < total; i++) {
+        post(analytics, users[i]);
+    }
+    auto secs = sw.Seconds();
+    auto count = allocCount;
+    auto bytes = allocBytes;
+    cb->Wait(total);
+
+    std::string label(what);
+    Report((label + " calls").c_str(), 0, total / secs, "events/s");
+    Report((label + " allocations").c_str(), 0, double(count) / total, "per event");
+    Report((label + " heap").c_str(), 0, double(bytes) / total, "bytes/event");
+}
+
+int main()
+{
+    const size_t total = 200000;
+    const Object props = SampleProperties(7);
+
+    std::printf("%-32s %6s %14s\n", "posting", "", "cost");
+    run("tree (PostEvent)", total, [&](Analytics& a, const std::string& user) {
+        a.PostEvent(a.CreateTrackEvent("Product Viewed", user, props));
+    });
+    run("envelope (Track)", total, [&](Analytics& a, const std::string& user) {
+        a.Track(user, "Product Viewed", props);
+    });
+    return 0;
+}
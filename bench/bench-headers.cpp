@@ -0,0 +1,133 @@
+//
+// Copyright 2017 Segment Inc. <friends@segment.com>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// bench-headers measures the fixed, per-batch cost of request headers.
+// It compares building them from scratch for every batch, as earlier
+// releases did (including the libcurl header list), against copying a
+// cached map, and against sharing one pre-rendered HeaderBlock.  It
+// then measures the per-batch overhead of Analytics end to end, with
+// single event batches and a transport that does no I/O.
+
+#include <algorithm>
+#include <sstream>
+
+#include <curl/curl.h>
+
+#include "bench.hpp"
+
+using namespace bench;
+
+static std::string base64(const std::string& in)
+{
+    static const char* digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    int val = 0, valb = -6;
+    for (unsigned char c : in) {
+        val = (val << 8) + c;
+        valb += 8;
+        while (valb >= 0) {
+            out.push_back(digits[(val >> valb) & 0x3F]);
+            valb -= 6;
+        }
+    }
+    if (valb > -6)
+        out.push_back(digits[((val << 8) >> (valb + 8)) & 0x3F]);
+    while (out.size() % 4)
+        out.push_back('=');
+    return out;
+}
+
+// legacy builds the headers as earlier releases did for every batch,
+// and then the libcurl list from them.
+static size_t legacy(Object& context, const std::string& writeKey)
+{
+    std::map<std::string, std::string> headers;
+    auto library = context["library"];
+    std::ostringstream ss;
+    ss << library["name"] << "/" << library["version"];
+    auto userAgent = ss.str();
+    userAgent.erase(std::remove(userAgent.begin(), userAgent.end(), '"'), userAgent.end());
+    headers["User-Agent"] = userAgent;
+    headers["Authorization"] = "Basic " + base64(writeKey + ":");
+    headers["Content-Type"] = "application/json";
+    headers["Accept"] = "application/json";
+
+    struct curl_slist* list = NULL;
+    for (auto const& item : headers) {
+        std::string line = item.first + ": " + item.second;
+        list = curl_slist_append(list, line.c_str());
+    }
+    curl_slist_free_all(list);
+    return headers.size();
+}
+
+// sharing is a NullHandler that takes shared header blocks.
+class sharing : public NullHandler {
+public:
+    bool SharesHeaders() const { return true; }
+};
+
+static double perBatch(std::shared_ptr<segment::http::Handler> handler, size_t batches)
+{
+    auto cb = std::make_shared<Counter>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = handler;
+    analytics.Callback = cb;
+    analytics.FlushCount = 1;
+
+    Stopwatch sw;
+    for (size_t i = 0; i < batches; i++) {
+        analytics.Track("user", "Header");
+    }
+    cb->Wait(batches);
+    return sw.Seconds() * 1e6 / batches;
+}
+
+int main()
+{
+    const size_t rounds = 200000;
+    Object context = { { "library", { { "name", "analytics-cpp" }, { "version", "0.9" } } } };
+    std::string writeKey = "0123456789abcdefghijklmnopqrstuv";
+
+    std::printf("%-32s %6s %14s\n", "headers per batch", "", "time");
+
+    Stopwatch sw;
+    size_t n = 0;
+    for (size_t i = 0; i < rounds; i++) {
+        n += legacy(context, writeKey);
+    }
+    Report("rebuilt every batch", 0, sw.Seconds() * 1e9 / rounds, "nsec");
+
+    std::map<std::string, std::string> cached;
+    cached["User-Agent"] = "analytics-cpp/0.9";
+    cached["Authorization"] = "Basic " + base64(writeKey + ":");
+    cached["Content-Type"] = "application/json";
+    cached["Accept"] = "application/json";
+    sw.Reset();
+    for (size_t i = 0; i < rounds; i++) {
+        segment::http::Request req;
+        req.Headers = cached;
+        n += req.Headers.size();
+    }
+    Report("cached map, copied", 0, sw.Seconds() * 1e9 / rounds, "nsec");
+
+    auto block = std::make_shared<const segment::http::HeaderBlock>(cached);
+    sw.Reset();
+    for (size_t i = 0; i < rounds; i++) {
+        segment::http::Request req;
+        req.Common = block;
+        n += req.Common->Lines.size();
+    }
+    Report("shared HeaderBlock", 0, sw.Seconds() * 1e9 / rounds, "nsec");
+
+    std::printf("\n%-32s %6s %14s\n", "end-to-end (null transport)", "batch", "time");
+    Report("Headers map", 1, perBatch(std::make_shared<NullHandler>(), 20000), "usec/batch");
+    Report("shared HeaderBlock", 1, perBatch(std::make_shared<sharing>(), 20000), "usec/batch");
+    return n > 0 ? 0 : 1;
+}
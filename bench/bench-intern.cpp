@@ -0,0 +1,203 @@
+//
+// Copyright 2017 Segment Inc. <friends@segment.com>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// bench-intern measures building and posting events drawn from a corpus
+// like that of a busy service: a few hundred event names, a couple of
+// hundred property keys, names and keys reused with a skewed frequency,
+// and eight properties of mixed types per event.  It compares the usual
+// call, with names and keys as string literals and properties built as
+// an Object, against Track with Symbols and Properties.  For each, it
+// reports calls per second and the heap allocations (count and bytes)
+// per event on the calling thread; and the same for building the
+// properties alone.
+
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <vector>
+
+#include "bench.hpp"
+
+using namespace bench;
+
+// Count allocations made by each thread, so that the worker's share is
+// left out.
+static thread_local size_t allocCount;
+static thread_local size_t allocBytes;
+
+void* operator new(size_t n)
+{
+    allocCount++;
+    allocBytes += n;
+    void* p = std::malloc(n == 0 ? 1 : n);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+static const size_t names = 300;
+static const size_t keys = 200;
+static const size_t perEvent = 8;
+
+// sample is one event of the corpus: which name and keys it uses (as
+// indexes), and its values.
+struct sample {
+    size_t name;
+    size_t key[perEvent];
+    std::string text;
+    std::string id;
+    long long count;
+    long long amount;
+    double price;
+    bool flag;
+};
+
+static const char* words[] = { "Product", "Order", "Cart", "Checkout", "Promotion", "Coupon",
+    "Viewed", "Added", "Removed", "Completed", "Started", "Clicked", "Shared", "Reviewed" };
+
+// Make n distinct names, e.g. "Cart Viewed 17".
+static std::vector<std::string> corpus(size_t n, std::mt19937& rng)
+{
+    std::vector<std::string> out;
+    std::uniform_int_distribution<size_t> word(0, sizeof(words) / sizeof(words[0]) - 1);
+    for (size_t i = 0; i < n; i++) {
+        std::string s = words[word(rng)];
+        s += ' ';
+        s += words[word(rng)];
+        s += ' ';
+        s += std::to_string(i);
+        out.push_back(s);
+    }
+    return out;
+}
+
+// Pick an index in [0, n), favoring the low ones as real traffic does.
+static size_t skewed(size_t n, std::mt19937& rng)
+{
+    std::exponential_distribution<double> d(8.0 / n);
+    return size_t(d(rng)) % n;
+}
+
+template <typename F>
+static void measure(const char* what, size_t total, F f)
+{
+    allocCount = 0;
+    allocBytes = 0;
+    Stopwatch sw;
+    for (size_t i = 0; i < total; i++) {
+        f(i);
+    }
+    auto secs = sw.Seconds();
+    auto count = allocCount;
+    auto bytes = allocBytes;
+
+    std::string label(what);
+    Report((label + " calls").c_str(), 0, total / secs, "events/s");
+    Report((label + " allocations").c_str(), 0, double(count) / total, "per event");
+    Report((label + " heap").c_str(), 0, double(bytes) / total, "bytes/event");
+}
+
+int main()
+{
+    const size_t total = 200000;
+    std::mt19937 rng(1);
+
+    // The names and keys are held as C strings, as literals would be.
+    auto nameStrings = corpus(names, rng);
+    auto keyStrings = corpus(keys, rng);
+    std::vector<const char*> nameText;
+    std::vector<const char*> keyText;
+    std::vector<Symbol> nameSymbols;
+    std::vector<Symbol> keySymbols;
+    for (auto const& s : nameStrings) {
+        nameText.push_back(s.c_str());
+        nameSymbols.push_back(Symbol(s));
+    }
+    for (auto const& s : keyStrings) {
+        keyText.push_back(s.c_str());
+        keySymbols.push_back(Symbol(s));
+    }
+
+    std::vector<sample> events(total);
+    for (auto& ev : events) {
+        ev.name = skewed(names, rng);
+        for (size_t k = 0; k < perEvent; k++) {
+            // Distinct keys for each event.
+            ev.key[k] = (skewed(keys / perEvent, rng) * perEvent + k) % keys;
+        }
+        ev.text = "Monopoly: 3rd Edition";
+        ev.id = "G-" + std::to_string(rng() % 100000);
+        ev.count = rng() % 10;
+        ev.amount = rng() % 100000;
+        ev.price = (rng() % 10000) / 100.0;
+        ev.flag = (rng() % 2) != 0;
+    }
+
+    auto tree = [&](const sample& ev) {
+        return Object{
+            { keyText[ev.key[0]], ev.text },
+            { keyText[ev.key[1]], ev.id },
+            { keyText[ev.key[2]], ev.count },
+            { keyText[ev.key[3]], ev.amount },
+            { keyText[ev.key[4]], ev.price },
+            { keyText[ev.key[5]], ev.flag },
+            { keyText[ev.key[6]], "https://www.example.com/product/path" },
+            { keyText[ev.key[7]], "Games" },
+        };
+    };
+    auto built = [&](const sample& ev) {
+        Properties p;
+        p.Set(keySymbols[ev.key[0]], ev.text)
+            .Set(keySymbols[ev.key[1]], ev.id)
+            .Set(keySymbols[ev.key[2]], ev.count)
+            .Set(keySymbols[ev.key[3]], ev.amount)
+            .Set(keySymbols[ev.key[4]], ev.price)
+            .Set(keySymbols[ev.key[5]], ev.flag)
+            .Set(keySymbols[ev.key[6]], "https://www.example.com/product/path")
+            .Set(keySymbols[ev.key[7]], "Games");
+        return p;
+    };
+
+    size_t sink = 0;
+    measure("build Object", total, [&](size_t i) { sink += tree(events[i]).size(); });
+    measure("build Properties", total, [&](size_t i) { sink += built(events[i]).Dump().size(); });
+    measure("look up Symbol", total, [&](size_t i) {
+        Symbol s(keyText[events[i].key[0]]);
+        sink += s.str().size();
+    });
+
+    std::vector<std::string> users;
+    for (size_t i = 0; i < total; i++) {
+        users.push_back("user" + std::to_string(i));
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        auto cb = std::make_shared<Counter>();
+        Analytics analytics("writeKey", "http://localhost");
+        analytics.Handler = std::make_shared<NullHandler>();
+        analytics.Callback = cb;
+        analytics.FlushCount = 250;
+        if (pass == 0) {
+            measure("Track Object", total, [&](size_t i) {
+                analytics.Track(users[i], nameText[events[i].name], tree(events[i]));
+            });
+        } else {
+            measure("Track Properties", total, [&](size_t i) {
+                analytics.Track(users[i], nameSymbols[events[i].name], built(events[i]));
+            });
+        }
+        cb->Wait(total);
+    }
+    return sink > 0 ? 0 : 1;
+}
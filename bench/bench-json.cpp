@@ -0,0 +1,88 @@
+//
+// Copyright 2017 Segment Inc. <friends@segment.com>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// bench-json compares the throughput, in MB of JSON text written per
+// second, of Object::dump against ToJSON, for a few kinds of document:
+// a typical track event, one heavy with long strings, one heavy with
+// numbers, and a whole batch of typical events.  It also checks that
+// the two write the same bytes.
+
+#include <vector>
+
+#include "bench.hpp"
+
+using namespace bench;
+
+static Event track(int i)
+{
+    Event ev;
+    ev["type"] = "track";
+    ev["event"] = "Product Viewed";
+    ev["userId"] = "user" + std::to_string(i);
+    ev["timestamp"] = TimeStamp();
+    ev["properties"] = SampleProperties(i);
+    return ev;
+}
+
+template <typename F>
+static double rate(const Object& doc, F write)
+{
+    // Run for long enough to swamp the clock's resolution.
+    size_t bytes = 0;
+    size_t rounds = 0;
+    Stopwatch sw;
+    do {
+        for (int i = 0; i < 100; i++) {
+            bytes += write(doc).size();
+        }
+        rounds++;
+    } while (sw.Seconds() < 0.5);
+    return bytes / sw.Seconds() / 1e6;
+}
+
+int main()
+{
+    std::vector<std::pair<const char*, Object>> docs;
+    docs.push_back({ "track event", track(1) });
+
+    auto text = track(2);
+    std::string para;
+    for (int i = 0; i < 8; i++) {
+        para += "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor. ";
+    }
+    text["properties"]["description"] = para;
+    text["properties"]["review"] = "\"Great\" game,\nwould play again. " + para;
+    text["context"]["userAgent"] = "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko)";
+    docs.push_back({ "string heavy event", text });
+
+    auto numbers = track(3);
+    for (int i = 0; i < 64; i++) {
+        numbers["properties"]["samples"].push_back(i * 1.37);
+        numbers["properties"]["counts"].push_back(i * 1009);
+    }
+    docs.push_back({ "number heavy event", numbers });
+
+    Object batch = Object::array();
+    for (int i = 0; i < 250; i++) {
+        batch.push_back(track(i));
+    }
+    docs.push_back({ "batch of 250 events", batch });
+
+    std::printf("%-32s %6s %14s\n", "writer", "", "MB/s");
+    for (auto const& d : docs) {
+        if (ToJSON(d.second) != d.second.dump()) {
+            std::printf("%s: ToJSON and dump differ\n", d.first);
+            return 1;
+        }
+        std::string label(d.first);
+        Report((label + ", dump").c_str(), 0, rate(d.second, [](const Object& o) { return o.dump(); }), "MB/s");
+        Report((label + ", ToJSON").c_str(), 0, rate(d.second, [](const Object& o) { return ToJSON(o); }), "MB/s");
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+//
+// Copyright 2017 Segment Inc. <friends@segment.com>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// bench-latency measures how long the library itself takes to react:
+// the time from posting an event until the transport is asked to send
+// it (with FlushCount of 1), and how long FlushWait takes to return
+// for a handful of queued events.  The transport does no I/O.
+
+#include <algorithm>
+#include <vector>
+
+#include "bench.hpp"
+
+using namespace bench;
+
+// stamp records the time at which it was last asked to send.
+class stamp : public segment::http::Handler {
+public:
+    std::unique_ptr<segment::http::Response> Handle(const segment::http::Request&)
+    {
+        std::lock_guard<std::mutex> l(lk);
+        when = std::chrono::steady_clock::now();
+        calls++;
+        cv.notify_all();
+        auto resp = std::unique_ptr<segment::http::Response>(new segment::http::Response());
+        resp->Code = 200;
+        return resp;
+    }
+
+    std::chrono::steady_clock::time_point Wait(int n)
+    {
+        std::unique_lock<std::mutex> l(lk);
+        while (calls < n) {
+            cv.wait(l);
+        }
+        return when;
+    }
+
+    std::mutex lk;
+    std::condition_variable cv;
+    std::chrono::steady_clock::time_point when;
+    int calls = 0;
+};
+
+static void summarize(const char* what, size_t batch, std::vector<double>& usec)
+{
+    std::sort(usec.begin(), usec.end());
+    Report((std::string(what) + " p50").c_str(), batch, usec[usec.size() / 2], "usec");
+    Report((std::string(what) + " p99").c_str(), batch, usec[usec.size() * 99 / 100], "usec");
+}
+
+int main()
+{
+    const int trials = 500;
+
+    {
+        auto handler = std::make_shared<stamp>();
+        Analytics analytics("writeKey", "http://localhost");
+        analytics.Handler = handler;
+        analytics.FlushCount = 1;
+
+        std::vector<double> usec;
+        for (int i = 0; i < trials; i++) {
+            auto start = std::chrono::steady_clock::now();
+            analytics.Track("user", "Latency");
+            auto end = handler->Wait(i + 1);
+            usec.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+        }
+        summarize("enqueue to Handle", 1, usec);
+    }
+
+    size_t sizes[] = { 1, 5, 20 };
+    for (auto count : sizes) {
+        Analytics analytics("writeKey", "http://localhost");
+        analytics.Handler = std::make_shared<NullHandler>();
+
+        std::vector<double> usec;
+        for (int i = 0; i < trials; i++) {
+            for (size_t j = 0; j < count; j++) {
+                analytics.Track("user", "Latency");
+            }
+            Stopwatch sw;
+            analytics.FlushWait();
+            usec.push_back(sw.Seconds() * 1e6);
+        }
+        summarize("FlushWait", count, usec);
+    }
+    return 0;
+}
@@ -0,0 +1,138 @@
+//
+// Copyright 2017 Segment Inc. <friends@segment.com>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// bench-pool compares JSON trees allocated from the heap (the default)
+// with trees allocated through PoolAllocator.  It measures how quickly
+// events can be built and torn down a batch at a time, and parsed back
+// from their serialized form (as the worker does for callbacks); and,
+// with glibc, how much memory the heap holds after a long run of events
+// of mixed sizes, relative to what is still in use.
+
+#include <cstdlib>
+#include <vector>
+
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define BENCH_MALLINFO
+#endif
+
+#include "bench.hpp"
+
+using namespace bench;
+
+typedef nlohmann::basic_json<std::map, std::vector, std::string, bool,
+    std::int64_t, std::uint64_t, double, PoolAllocator>
+    pooled;
+
+template <typename J>
+static J sample(int i)
+{
+    J ev;
+    ev["type"] = "track";
+    ev["event"] = "Product Viewed";
+    ev["userId"] = "user" + std::to_string(i);
+    ev["properties"] = J::parse(SampleProperties(i).dump());
+    ev["properties"]["tags"] = { "a", "b", i };
+    return ev;
+}
+
+// build makes and drops batches of events.
+template <typename J>
+static double build(size_t batches, size_t count)
+{
+    auto props = J::parse(SampleProperties(1).dump());
+    Stopwatch sw;
+    for (size_t b = 0; b < batches; b++) {
+        std::vector<J> batch;
+        batch.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            J ev;
+            ev["type"] = "track";
+            ev["event"] = "Product Viewed";
+            ev["userId"] = "user";
+            ev["properties"] = props;
+            batch.push_back(std::move(ev));
+        }
+    }
+    return batches * count / sw.Seconds();
+}
+
+// parse reads serialized events back into trees, a batch at a time.
+template <typename J>
+static double parse(size_t batches, size_t count)
+{
+    std::vector<std::string> data;
+    for (size_t i = 0; i < count; i++) {
+        data.push_back(sample<J>(int(i)).dump());
+    }
+    Stopwatch sw;
+    for (size_t b = 0; b < batches; b++) {
+        std::vector<J> batch;
+        batch.reserve(count);
+        for (auto const& d : data) {
+            batch.push_back(J::parse(d));
+        }
+    }
+    return batches * count / sw.Seconds();
+}
+
+#ifdef BENCH_MALLINFO
+// churn keeps a window of events alive, replacing them at random with
+// events of other sizes, and then reports the heap the process holds
+// per event still alive.  It runs in a child process, so that each kind
+// of tree starts from a fresh heap.
+template <typename J>
+static void churn(const char* what)
+{
+    std::fflush(stdout);
+    if (fork() != 0) {
+        wait(nullptr);
+        return;
+    }
+    const size_t window = 20000;
+    std::vector<J> live(window);
+    std::srand(1);
+    for (size_t i = 0; i < 20 * window; i++) {
+        auto& ev = live[std::rand() % window];
+        ev = sample<J>(int(i));
+        for (int k = std::rand() % 8; k > 0; k--) {
+            ev["properties"]["extra" + std::to_string(k)] = { { "k", k } };
+        }
+    }
+    // Drop most of them, as a burst ends.
+    live.resize(window / 10);
+    auto mi = mallinfo2();
+    Report((std::string(what) + " held").c_str(), 0, double(mi.arena + mi.hblkhd) / live.size(), "bytes/event");
+    std::fflush(stdout);
+    _exit(0);
+}
+#endif
+
+int main()
+{
+    size_t sizes[] = { 50, 250 };
+
+    std::printf("%-32s %6s %14s\n", "trees", "batch", "rate");
+    for (auto count : sizes) {
+        size_t batches = 200000 / count;
+        Report("build (heap)", count, build<nlohmann::json>(batches, count), "events/s");
+        Report("build (pool)", count, build<pooled>(batches, count), "events/s");
+        Report("parse (heap)", count, parse<nlohmann::json>(batches / 4, count), "events/s");
+        Report("parse (pool)", count, parse<pooled>(batches / 4, count), "events/s");
+    }
+
+#ifdef BENCH_MALLINFO
+    std::printf("\n%-32s %6s %14s\n", "fragmentation", "", "heap");
+    churn<nlohmann::json>("heap");
+    churn<pooled>("pool");
+#endif
+    return 0;
+}
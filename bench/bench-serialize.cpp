@@ -0,0 +1,147 @@
+//
+// Copyright 2017 Segment Inc. <friends@segment.com>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// bench-serialize compares holding queued events as JSON trees, as
+// earlier releases did, against Analytics, which holds them as
+// serialized bytes.  It reports heap bytes per queued event for each,
+// and the CPU time spent per batch: building trees, copying them into a
+// document and dumping it, versus posting the same events through
+// Analytics with a transport that does no I/O.
+
+#include <atomic>
+#include <cstdlib>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+
+using namespace bench;
+using json = nlohmann::json;
+
+// Track live heap bytes.  Each allocation carries a small header with
+// its size, so that we can account for it when it is freed.
+static std::atomic<long long> liveBytes(0);
+
+void* operator new(size_t n)
+{
+    auto p = static_cast<size_t*>(std::malloc(n + 16));
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    *p = n;
+    liveBytes += n;
+    return reinterpret_cast<char*>(p) + 16;
+}
+
+void operator delete(void* p) noexcept
+{
+    if (p != nullptr) {
+        auto h = reinterpret_cast<size_t*>(static_cast<char*>(p) - 16);
+        liveBytes -= *h;
+        std::free(h);
+    }
+}
+
+static Event sample(int i)
+{
+    Event ev;
+    ev["type"] = "track";
+    ev["event"] = "Product Viewed";
+    ev["userId"] = "user" + std::to_string(i);
+    ev["timestamp"] = TimeStamp();
+    ev["properties"] = SampleProperties(i);
+    return ev;
+}
+
+// post makes an Analytics that sends nothing until flushed, and posts
+// n sample events to it.
+static std::unique_ptr<Analytics> post(int n, std::shared_ptr<Counter> cb)
+{
+    std::unique_ptr<Analytics> analytics(new Analytics("writeKey", "http://localhost"));
+    analytics->Handler = std::make_shared<NullHandler>();
+    analytics->Callback = cb;
+    analytics->FlushCount = size_t(n) + 1;
+    analytics->FlushSize = size_t(-1);
+    analytics->FlushInterval = std::chrono::seconds(3600);
+    for (int i = 0; i < n; i++) {
+        analytics->Track("user" + std::to_string(i), "Product Viewed", SampleProperties(i));
+    }
+    return analytics;
+}
+
+int main()
+{
+    const int queued = 10000;
+    const int batches = 200;
+    const size_t batchCount = 250;
+
+    {
+        auto before = liveBytes.load();
+        std::deque<Event> trees;
+        for (int i = 0; i < queued; i++) {
+            trees.push_back(sample(i));
+        }
+        Report("heap per queued event (tree)", 0, double(liveBytes - before) / queued, "bytes");
+    }
+    {
+        // Leave out what an idle Analytics holds.
+        auto cb = std::make_shared<Counter>();
+        auto idle = post(0, cb);
+        auto before = liveBytes.load();
+        auto analytics = post(queued, cb);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        Report("heap per queued event (bytes)", 0, double(liveBytes - before) / queued, "bytes");
+        analytics->Flush();
+        cb->Wait(queued);
+    }
+
+    json context = { { "library", { { "name", "analytics-cpp" }, { "version", "0.9" } } } };
+    size_t total = 0;
+
+    auto start = std::clock();
+    for (int b = 0; b < batches; b++) {
+        std::deque<Event> trees;
+        for (size_t i = 0; i < batchCount; i++) {
+            trees.push_back(sample(int(i)));
+        }
+        json body;
+        body["batch"] = trees;
+        body["context"] = context;
+        body["sentAt"] = TimeStamp();
+        total += body.dump().size();
+    }
+    auto usec = double(std::clock() - start) * 1e6 / CLOCKS_PER_SEC / batches;
+    Report("CPU per batch (tree)", batchCount, usec, "usec");
+
+    // clock counts the CPU time of every thread: the caller's, and that
+    // of the worker and sender.
+    start = std::clock();
+    {
+        auto cb = std::make_shared<Counter>();
+        Analytics analytics("writeKey", "http://localhost");
+        analytics.Handler = std::make_shared<NullHandler>();
+        analytics.Callback = cb;
+        analytics.FlushCount = batchCount;
+        analytics.FlushInterval = std::chrono::seconds(3600);
+        for (int b = 0; b < batches; b++) {
+            for (size_t i = 0; i < batchCount; i++) {
+                analytics.Track("user" + std::to_string(i), "Product Viewed", SampleProperties(int(i)));
+            }
+        }
+        cb->Wait(batches * batchCount);
+    }
+    usec = double(std::clock() - start) * 1e6 / CLOCKS_PER_SEC / batches;
+    Report("CPU per batch (bytes)", batchCount, usec, "usec");
+
+    return total > 0 ? 0 : 1;
+}
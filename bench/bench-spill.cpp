@@ -0,0 +1,112 @@
+//
+// Copyright 2017 Segment Inc. <friends@segment.com>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// bench-spill measures the disk spool.  While the transport is held
+// closed, events overflow to segment files; we report how quickly they
+// are written out, and then how quickly they are read back and
+// delivered once the transport opens.  The spool lives in a temporary
+// directory, so results depend on the file system backing it.
+
+#ifndef _WIN32
+
+#include <cstdlib>
+#include <thread>
+#include <unistd.h>
+
+#include "bench.hpp"
+
+using namespace bench;
+
+// gate blocks every request until it is opened.
+class gate : public segment::http::Handler {
+public:
+    gate()
+        : open(false)
+    {
+    }
+    std::unique_ptr<segment::http::Response> Handle(const segment::http::Request&)
+    {
+        {
+            std::unique_lock<std::mutex> l(lk);
+            while (!open) {
+                cv.wait(l);
+            }
+        }
+        auto resp = std::unique_ptr<segment::http::Response>(new segment::http::Response());
+        resp->Code = 200;
+        return resp;
+    }
+    void Open()
+    {
+        std::lock_guard<std::mutex> l(lk);
+        open = true;
+        cv.notify_all();
+    }
+
+private:
+    std::mutex lk;
+    std::condition_variable cv;
+    bool open;
+};
+
+int main()
+{
+    const size_t total = 200000;
+    const size_t threshold = 1000;
+    const size_t flushCount = 250;
+
+    char tmpl[] = "/tmp/bench-spill-XXXXXX";
+    if (mkdtemp(tmpl) == nullptr) {
+        std::perror("mkdtemp");
+        return 1;
+    }
+
+    auto handler = std::make_shared<gate>();
+    auto cb = std::make_shared<Counter>();
+    {
+        Analytics analytics("writeKey", "http://localhost");
+        analytics.Handler = handler;
+        analytics.Callback = cb;
+        analytics.FlushCount = flushCount;
+        analytics.MaxInFlight = 1;
+        analytics.SpillThreshold = threshold;
+        analytics.EnableSpill(tmpl);
+
+        Stopwatch sw;
+        for (size_t i = 0; i < total; i++) {
+            analytics.Track("user" + std::to_string(i), "Product Viewed", SampleProperties(int(i)));
+        }
+        // Everything beyond the in-memory threshold, and the batch
+        // held by the closed transport, ends up on disk.
+        while (analytics.GetMetrics().SpilledEvents + threshold + 2 * flushCount < total) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        auto spilled = analytics.GetMetrics().SpilledEvents;
+        Report("spill to segment files", flushCount, spilled / sw.Seconds(), "events/s");
+
+        sw.Reset();
+        handler->Open();
+        cb->Wait(total);
+        Report("drain and deliver", flushCount, total / sw.Seconds(), "events/s");
+    }
+    rmdir(tmpl);
+    return 0;
+}
+
+#else
+
+#include <cstdio>
+
+int main()
+{
+    std::printf("The disk spool is not supported on this platform.\n");
+    return 0;
+}
+
+#endif
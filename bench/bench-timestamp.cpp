@@ -0,0 +1,68 @@
+//
+// Copyright 2017 Segment Inc. <friends@segment.com>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// bench-timestamp measures how quickly time stamps can be formatted:
+// through date::format, as every event and batch used to be stamped,
+// and through TimeStamp, which reuses the part of the last stamp that
+// is still current.  Both read the clock each time, as the library does.
+
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "date.hpp"
+
+using namespace bench;
+
+template <typename F>
+static double rate(size_t count, F stamp)
+{
+    size_t total = 0;
+    Stopwatch sw;
+    for (size_t i = 0; i < count; i++) {
+        total += stamp().size();
+    }
+    auto secs = sw.Seconds();
+    return total > 0 ? count / secs : 0;
+}
+
+int main()
+{
+    const size_t count = 1000000;
+
+    auto formatted = []() {
+        auto now = std::chrono::system_clock::now();
+        return date::format("%FT%TZ", std::chrono::time_point_cast<std::chrono::milliseconds>(now));
+    };
+    auto cached = []() { return TimeStamp(); };
+
+    std::printf("%-32s %6s %14s\n", "time stamps", "thrds", "rate");
+    Report("date::format", 1, rate(count, formatted), "stamps/s");
+    Report("TimeStamp", 1, rate(count, cached), "stamps/s");
+
+    // Each thread has a cache of its own, so there is nothing to contend
+    // for.
+    int counts[] = { 2, 4 };
+    for (auto n : counts) {
+        std::vector<std::thread> threads;
+        std::vector<double> rates(n);
+        for (int t = 0; t < n; t++) {
+            threads.push_back(std::thread([&rates, &cached, t, count]() {
+                rates[t] = rate(count, cached);
+            }));
+        }
+        double sum = 0;
+        for (int t = 0; t < n; t++) {
+            threads[t].join();
+            sum += rates[t];
+        }
+        Report("TimeStamp", n, sum, "stamps/s");
+    }
+    return 0;
+}
@@ -0,0 +1,109 @@
+//
+// Copyright 2017 Segment Inc. <friends@segment.com>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef SEGMENT_BENCH_HPP_
+#define SEGMENT_BENCH_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+#include "analytics.hpp"
+
+// Common helpers for the benchmark programs.
+
+namespace bench {
+
+using namespace segment::analytics;
+
+/// Stopwatch measures elapsed wall clock time.
+class Stopwatch {
+public:
+    Stopwatch() { Reset(); }
+    void Reset() { start = std::chrono::steady_clock::now(); }
+
+    /// Seconds returns the time elapsed since construction or Reset.
+    double Seconds() const
+    {
+        std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+        return d.count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+/// NullHandler accepts every request instantly, without any I/O.  It
+/// isolates the cost of the library itself from that of the network.
+class NullHandler : public segment::http::Handler {
+public:
+    std::unique_ptr<segment::http::Response> Handle(const segment::http::Request&)
+    {
+        auto resp = std::unique_ptr<segment::http::Response>(new segment::http::Response());
+        resp->Code = 200;
+        resp->Message = "OK";
+        return resp;
+    }
+};
+
+/// Counter is a callback that counts completed events, and lets the
+/// caller wait for a given number of them.
+class Counter : public Callback {
+public:
+    Counter()
+        : count(0)
+    {
+    }
+    void Success(const Event&) { done(); }
+    void Failure(const Event&, const std::string&) { done(); }
+
+    void Wait(size_t num)
+    {
+        std::unique_lock<std::mutex> l(lk);
+        while (count < num) {
+            cv.wait(l);
+        }
+    }
+
+private:
+    void done()
+    {
+        std::lock_guard<std::mutex> l(lk);
+        count++;
+        cv.notify_all();
+    }
+    std::mutex lk;
+    std::condition_variable cv;
+    size_t count;
+};
+
+/// SampleProperties returns a modest, but realistic, properties object.
+inline Object SampleProperties(int n)
+{
+    return Object{
+        { "sku", "G-" + std::to_string(n) },
+        { "name", "Monopoly: 3rd Edition" },
+        { "price", 19.99 },
+        { "quantity", n % 7 },
+        { "category", "Games" },
+        { "url", "https://www.example.com/product/path" },
+    };
+}
+
+/// Report prints a result line in a uniform format.
+inline void Report(const char* what, size_t batch, double rate, const char* unit)
+{
+    std::printf("%-32s %6zu %14.0f %s\n", what, batch, rate, unit);
+}
+
+} // namespace bench
+
+#endif // SEGMENT_BENCH_HPP_
@@ -0,0 +1,233 @@
+//
+// Copyright 2017 Segment Inc. <friends@segment.com>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef SEGMENT_BENCH_STANDIN_HPP_
+#define SEGMENT_BENCH_STANDIN_HPP_
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef BENCH_TLS
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+
+// A stand-in for the Segment API, for the benchmarks that need a real
+// server on the other end of a socket.  POSIX only.
+
+namespace bench {
+
+// standin is a minimal HTTP/1.1 server, one thread per connection.
+class standin {
+public:
+    standin(bool tls)
+        : Received(0)
+#ifdef BENCH_TLS
+        , ctx(nullptr)
+#endif
+        , stop(false)
+    {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(sa);
+        if ((bind(fd, (struct sockaddr*)&sa, len) != 0) || (listen(fd, 64) != 0)) {
+            std::perror("listen");
+            std::exit(1);
+        }
+        getsockname(fd, (struct sockaddr*)&sa, &len);
+        port = ntohs(sa.sin_port);
+#ifdef BENCH_TLS
+        if (tls) {
+            makeCert();
+        }
+#endif
+        (void)tls;
+        thr = std::thread([this]() { acceptLoop(); });
+    }
+
+    ~standin()
+    {
+        stop = true;
+        shutdown(fd, SHUT_RDWR);
+        close(fd);
+        thr.join();
+        for (auto& t : conns) {
+            t.join();
+        }
+#ifdef BENCH_TLS
+        if (ctx != nullptr) {
+            SSL_CTX_free(ctx);
+            std::remove(CAFile.c_str());
+        }
+#endif
+    }
+
+    std::string Host() const
+    {
+        return std::string(tlsEnabled() ? "https" : "http") + "://localhost:" + std::to_string(port);
+    }
+    std::string URL() const { return Host() + "/v1/batch"; }
+
+    // CAFile names the certificate that clients must trust.
+    std::string CAFile;
+
+    // Received counts the body bytes of every request served.
+    std::atomic<size_t> Received;
+
+private:
+    bool tlsEnabled() const
+    {
+#ifdef BENCH_TLS
+        return ctx != nullptr;
+#else
+        return false;
+#endif
+    }
+
+    void acceptLoop()
+    {
+        int c;
+        while ((c = accept(fd, nullptr, nullptr)) >= 0) {
+            int one = 1;
+            setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            conns.push_back(std::thread([this, c]() { serve(c); }));
+        }
+    }
+
+    void serve(int c)
+    {
+#ifdef BENCH_TLS
+        SSL* ssl = nullptr;
+        if (ctx != nullptr) {
+            ssl = SSL_new(ctx);
+            SSL_set_fd(ssl, c);
+            if (SSL_accept(ssl) <= 0) {
+                SSL_free(ssl);
+                close(c);
+                return;
+            }
+        }
+        auto rd = [&](char* b, size_t n) -> long { return ssl ? SSL_read(ssl, b, int(n)) : read(c, b, n); };
+        auto wr = [&](const char* b, size_t n) -> long { return ssl ? SSL_write(ssl, b, int(n)) : write(c, b, n); };
+#else
+        auto rd = [&](char* b, size_t n) -> long { return read(c, b, n); };
+        auto wr = [&](const char* b, size_t n) -> long { return write(c, b, n); };
+#endif
+        static const char reply[] = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+        std::string in;
+        char buf[65536];
+        while (!stop) {
+            size_t end;
+            while ((end = in.find("\r\n\r\n")) == std::string::npos) {
+                long n = rd(buf, sizeof(buf));
+                if (n <= 0) {
+                    goto done;
+                }
+                in.append(buf, n);
+            }
+            size_t want = 0;
+            auto cl = in.find("Content-Length:");
+            if ((cl != std::string::npos) && (cl < end)) {
+                want = std::strtoul(in.c_str() + cl + 15, nullptr, 10);
+            }
+            while (in.size() < end + 4 + want) {
+                long n = rd(buf, sizeof(buf));
+                if (n <= 0) {
+                    goto done;
+                }
+                in.append(buf, n);
+            }
+            in.erase(0, end + 4 + want);
+            Received += want;
+            if (wr(reply, sizeof(reply) - 1) <= 0) {
+                break;
+            }
+        }
+    done:
+#ifdef BENCH_TLS
+        if (ssl != nullptr) {
+            SSL_free(ssl);
+        }
+#endif
+        close(c);
+    }
+
+#ifdef BENCH_TLS
+    // makeCert creates a self-signed certificate for "localhost", and
+    // writes it out so that the client can be told to trust it.
+    void makeCert()
+    {
+        EVP_PKEY* key = nullptr;
+        auto kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+        EVP_PKEY_keygen_init(kctx);
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx, NID_X9_62_prime256v1);
+        EVP_PKEY_keygen(kctx, &key);
+        EVP_PKEY_CTX_free(kctx);
+
+        auto x = X509_new();
+        X509_set_version(x, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+        X509_gmtime_adj(X509_getm_notBefore(x), 0);
+        X509_gmtime_adj(X509_getm_notAfter(x), 3600);
+        X509_set_pubkey(x, key);
+        auto name = X509_get_subject_name(x);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+        X509_set_issuer_name(x, name);
+        X509V3_CTX v3;
+        X509V3_set_ctx_nodb(&v3);
+        X509V3_set_ctx(&v3, x, x, nullptr, nullptr, 0);
+        auto ext = X509V3_EXT_conf_nid(nullptr, &v3, NID_subject_alt_name, (char*)"DNS:localhost");
+        X509_add_ext(x, ext, -1);
+        X509_EXTENSION_free(ext);
+        X509_sign(x, key, EVP_sha256());
+
+        char tmpl[] = "/tmp/bench-curl-XXXXXX";
+        int f = mkstemp(tmpl);
+        auto fp = fdopen(f, "w");
+        PEM_write_X509(fp, x);
+        std::fclose(fp);
+        CAFile = tmpl;
+
+        ctx = SSL_CTX_new(TLS_server_method());
+        SSL_CTX_use_certificate(ctx, x);
+        SSL_CTX_use_PrivateKey(ctx, key);
+        X509_free(x);
+        EVP_PKEY_free(key);
+    }
+
+    SSL_CTX* ctx;
+#endif
+
+    int fd;
+    int port;
+    volatile bool stop;
+    std::thread thr;
+    std::vector<std::thread> conns;
+};
+
+} // namespace bench
+
+#endif // SEGMENT_BENCH_STANDIN_HPP_
@@ -10,11 +10,15 @@
 #include "http-curl.hpp"
 
 #include <cstring>
+#include <deque>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
 #include <system_error>
+#include <thread>
 
 #include <curl/curl.h>
 
@@ -35,101 +39,208 @@ namespace http {
         CURLcode code;
     };
 
-    class curlReq {
+#define setopt(k, v)                                        \
+    if ((rv = curl_easy_setopt(req, k, v)) != CURLE_OK) {   \
+        if (rv == CURLE_OUT_OF_MEMORY) {                    \
+            throw std::bad_alloc();                         \
+        } else {                                            \
+            throw std::invalid_argument("bad curl option"); \
+        }                                                   \
+    }
+
+#define getinfo(k, v)                                      \
+    if ((rv = curl_easy_getinfo(req, k, v)) != CURLE_OK) { \
+        if (rv == CURLE_OUT_OF_MEMORY) {                   \
+            throw std::bad_alloc();                        \
+        }                                                  \
+    }
+
+    // shared holds the state common to all connections of a handler:
+    // TLS sessions and DNS lookups, so that a new connection can resume
+    // an earlier session instead of negotiating a new one.  libcurl
+    // asks us to lock each kind of data while it uses it.
+    class HandlerCurl::shared {
     public:
-        curlReq()
+        shared()
         {
+            if ((sh = curl_share_init()) == NULL) {
+                throw std::bad_alloc();
+            }
+            curl_share_setopt(sh, CURLSHOPT_LOCKFUNC, lockCallback);
+            curl_share_setopt(sh, CURLSHOPT_UNLOCKFUNC, unlockCallback);
+            curl_share_setopt(sh, CURLSHOPT_USERDATA, this);
+            curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+            curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        }
+        ~shared()
+        {
+            curl_share_cleanup(sh);
+        }
+
+        static void lockCallback(CURL*, curl_lock_data data, curl_lock_access, void* udata)
+        {
+            static_cast<shared*>(udata)->locks[data].lock();
+        }
+        static void unlockCallback(CURL*, curl_lock_data data, void* udata)
+        {
+            static_cast<shared*>(udata)->locks[data].unlock();
+        }
+
+        CURLSH* sh;
+
+    private:
+        std::mutex locks[CURL_LOCK_DATA_LAST];
+    };
+
+    // conn is a reusable easy handle.  libcurl keeps the connection it
+    // made open after a request completes, and uses it for the next
+    // request to the same host.  Options that never change are set once,
+    // when the handle is created; the header list is rebuilt only when
+    // the headers differ from those of the previous request.
+    class HandlerCurl::conn {
+    public:
+        conn(CURLSH* sh, const std::string& cainfo, long dnsTimeout)
+        {
+            CURLcode rv;
+
             this->headers = NULL;
-            this->req = NULL;
+            this->built = false;
+            if ((this->req = curl_easy_init()) == NULL) {
+                throw std::bad_alloc();
+            }
+            CURL* req = this->req;
+            try {
+                setopt(CURLOPT_SHARE, sh);
+                setopt(CURLOPT_DNS_CACHE_TIMEOUT, dnsTimeout);
+                setopt(CURLOPT_NOSIGNAL, 1L);
+                setopt(CURLOPT_TCP_KEEPALIVE, 1L);
+                setopt(CURLOPT_TCP_KEEPIDLE, 60L);
+                setopt(CURLOPT_TCP_KEEPINTVL, 30L);
+                setopt(CURLOPT_POST, 1L);
+                setopt(CURLOPT_WRITEFUNCTION, writeCallback);
+                setopt(CURLOPT_WRITEDATA, this);
+                setopt(CURLOPT_HEADERFUNCTION, headerCallback);
+                setopt(CURLOPT_HEADERDATA, this);
+                if (!cainfo.empty()) {
+                    setopt(CURLOPT_CAINFO, cainfo.c_str());
+                }
+            } catch (...) {
+                curl_easy_cleanup(req);
+                throw;
+            }
         }
-        ~curlReq()
+        ~conn()
         {
             if (this->headers != NULL) {
                 curl_slist_free_all(this->headers);
             }
-            if (this->req != NULL) {
-                curl_easy_cleanup(this->req);
-            }
+            curl_easy_cleanup(this->req);
         }
 
-        void addHeader(const std::string key, const std::string value)
+        // setHeaders builds the header list for a request.  Requests from
+        // Analytics share one HeaderBlock and have at most a header or two
+        // of their own, so the list is usually just the one we have.
+        void setHeaders(const Request& r)
         {
-            struct curl_slist* hdrs;
-            std::string line;
+            if (this->built && (r.Common == this->lastCommon) && (r.Headers == this->lastHeaders)) {
+                return;
+            }
+            if (this->headers != NULL) {
+                curl_slist_free_all(this->headers);
+                this->headers = NULL;
+            }
+            this->built = false;
+            if (r.Common != nullptr) {
+                for (auto const& line : r.Common->Lines) {
+                    addHeader(line);
+                }
+            }
+            for (auto const& item : r.Headers) {
+                addHeader(item.first + ": " + item.second);
+            }
+            // Holding the block keeps its address from being reused.
+            this->lastCommon = r.Common;
+            this->lastHeaders = r.Headers;
+            this->built = true;
+        }
 
-            line = key + ": " + value;
-            hdrs = curl_slist_append(this->headers, line.c_str());
-            if (hdrs == NULL) {
+        void addHeader(const std::string& line)
+        {
+            auto list = curl_slist_append(this->headers, line.c_str());
+            if (list == NULL) {
                 throw std::bad_alloc(); // cannot think of any other reason...
             }
-            this->headers = hdrs;
+            this->headers = list;
         }
 
-        void setBody(const std::string& body)
+        // headerCallback is given the status line, and then each header
+        // line, of every response (including interim ones, such as
+        // 100 Continue, which simply start over).
+        static size_t headerCallback(char* ptr, size_t sz, size_t nmemb, void* udata)
         {
-            this->body = body;
+            conn* c = (conn*)udata;
+            size_t nbytes = sz * nmemb;
+            std::string line(ptr, nbytes);
+            while (!line.empty() && ((line.back() == '\r') || (line.back() == '\n'))) {
+                line.pop_back();
+            }
+            if (line.compare(0, 5, "HTTP/") == 0) {
+                // "HTTP/1.1 429 Too Many Requests"; HTTP/2 has no reason.
+                c->respHeaders.clear();
+                c->respMessage.clear();
+                auto sp = line.find(' ');
+                sp = (sp == std::string::npos) ? sp : line.find(' ', sp + 1);
+                if (sp != std::string::npos) {
+                    c->respMessage = line.substr(sp + 1);
+                }
+                return (nbytes);
+            }
+            auto colon = line.find(':');
+            if (colon != std::string::npos) {
+                auto value = line.find_first_not_of(" \t", colon + 1);
+                c->respHeaders[line.substr(0, colon)] = (value == std::string::npos) ? "" : line.substr(value);
+            }
+            return (nbytes);
         }
 
         static size_t writeCallback(char* ptr, size_t sz, size_t nmemb, void* udata)
         {
-            curlReq* creq = (curlReq*)udata;
-            char* ucdata = (char*)udata;
+            conn* c = (conn*)udata;
             size_t nbytes = sz * nmemb;
-            creq->respData += std::string(ucdata, nbytes);
+            c->respData.append(ptr, nbytes);
             return (nbytes);
         }
 
-        void perform(const std::string meth, const std::string url)
+        // prepare sets up a POST of the body, which must remain valid
+        // until the request completes; libcurl reads it in place rather
+        // than copying it.
+        void prepare(const std::string& url, const std::string& body)
         {
-            CURL* req;
+            CURL* req = this->req;
             CURLcode rv;
-            long code;
-
-            if (meth != "POST") {
-                throw std::invalid_argument("Only POST supported");
-            }
-
-            if (this->req == NULL) {
-                this->req = curl_easy_init();
-            }
-            if ((req = this->req) == NULL) {
-                throw std::bad_alloc();
-            }
-
-#define setopt(k, v)                                        \
-    if ((rv = curl_easy_setopt(req, k, v)) != CURLE_OK) {   \
-        if (rv == CURLE_OUT_OF_MEMORY) {                    \
-            throw std::bad_alloc();                         \
-        } else {                                            \
-            throw std::invalid_argument("bad curl option"); \
-        }                                                   \
-    }
 
-            std::string body(this->body.begin(), this->body.end());
+            this->respData.clear();
+            this->respHeaders.clear();
+            this->respMessage.clear();
 
             // We only handle post.
             setopt(CURLOPT_URL, url.c_str());
             setopt(CURLOPT_POSTFIELDS, body.c_str());
-            setopt(CURLOPT_POSTFIELDSIZE, body.length());
-            setopt(CURLOPT_POST, 1);
+            setopt(CURLOPT_POSTFIELDSIZE, (long)body.length());
             setopt(CURLOPT_HTTPHEADER, this->headers);
-            setopt(CURLOPT_WRITEFUNCTION, this->writeCallback);
-            setopt(CURLOPT_WRITEDATA, this);
             //            setopt(CURLOPT_VERBOSE, 1);
-            //            printf("POSTING: %s\n", body.c_str());
+        }
 
-            if ((rv = curl_easy_perform(req)) != CURLE_OK) {
-                if (rv == CURLE_OUT_OF_MEMORY) {
-                    throw std::bad_alloc();
-                }
-            }
+        // finish collects the outcome of a completed request.
+        void finish(CURLcode result)
+        {
+            CURL* req = this->req;
+            CURLcode rv;
+            long code;
 
-#define getinfo(k, v)                                      \
-    if ((rv = curl_easy_getinfo(req, k, v)) != CURLE_OK) { \
-        if (rv == CURLE_OUT_OF_MEMORY) {                   \
-            throw std::bad_alloc();                        \
-        }                                                  \
-    }
+            if (result == CURLE_OUT_OF_MEMORY) {
+                throw std::bad_alloc();
+            }
 
             // get status
             getinfo(CURLINFO_RESPONSE_CODE, &code);
@@ -138,45 +249,285 @@ namespace http {
                 getinfo(CURLINFO_OS_ERRNO, &errn);
                 throw std::system_error((int)errn, std::system_category());
             }
-            if (code > 299) {
-                throw Error(code);
-            }
             this->respCode = (int)code;
         }
 
-        // This is probably not terribly idiomatic C++, but we put them
-        // here to make things easy.  C++ class friends would be better,
-        // but we're leaving this here in the implementation, so it should
-        // be fine.  These are used by the HttpHandlerCurl class.
+        void perform(const std::string& url, const std::string& body)
+        {
+            prepare(url, body);
+            finish(curl_easy_perform(this->req));
+        }
+
+        // warm makes a HEAD request, just to leave a connection open to
+        // the server, and then sets the handle back up for POST.  Any
+        // status will do.
+        void warm(const std::string& url)
+        {
+            CURL* req = this->req;
+            CURLcode rv;
+
+            this->respData.clear();
+            this->respHeaders.clear();
+            this->respMessage.clear();
+
+            setopt(CURLOPT_URL, url.c_str());
+            setopt(CURLOPT_HTTPHEADER, (struct curl_slist*)NULL);
+            setopt(CURLOPT_NOBODY, 1L);
+            auto result = curl_easy_perform(req);
+            setopt(CURLOPT_NOBODY, 0L);
+            setopt(CURLOPT_POST, 1L);
+            finish(result);
+        }
+
+        // response hands over the result of the last request.
+        std::unique_ptr<Response> response()
+        {
+            auto resp = std::unique_ptr<Response>(new Response());
+            resp->Code = this->respCode;
+            resp->Message = std::move(this->respMessage);
+            resp->Headers = std::move(this->respHeaders);
+            resp->Body = std::move(this->respData);
+            return resp;
+        }
+
+        CURL* handle() { return this->req; }
 
         std::string respData;
         std::string respMessage;
+        std::map<std::string, std::string> respHeaders;
         int respCode;
 
     private:
-        struct curl_slist* headers;
-        std::string body;
         CURL* req;
+        struct curl_slist* headers;
+        bool built;
+        std::shared_ptr<const HeaderBlock> lastCommon;
+        std::map<std::string, std::string> lastHeaders;
     };
 
-    std::unique_ptr<Response> HandlerCurl::Handle(const Request& req)
+    HandlerCurl::HandlerCurl()
     {
+        Reuse = true;
+        MaxIdle = 4;
+        DNSCacheTimeout = std::chrono::minutes(5);
+        share = std::unique_ptr<shared>(new shared());
+    }
+
+    HandlerCurl::~HandlerCurl()
+    {
+        // Connections must go before the share they use.
+        idle.clear();
+    }
 
-        auto resp = std::unique_ptr<Response>(new Response());
-        curlReq creq;
+    std::unique_ptr<HandlerCurl::conn> HandlerCurl::acquire()
+    {
+        {
+            std::lock_guard<std::mutex> l(lk);
+            if (Reuse && !idle.empty()) {
+                auto c = std::move(idle.back());
+                idle.pop_back();
+                return c;
+            }
+        }
+        return std::unique_ptr<conn>(new conn(share->sh, CAInfo, (long)DNSCacheTimeout.count()));
+    }
 
-        for (auto const& item : req.Headers) {
-            creq.addHeader(item.first, item.second);
+    void HandlerCurl::release(std::unique_ptr<conn> c)
+    {
+        std::lock_guard<std::mutex> l(lk);
+        if (Reuse && idle.size() < MaxIdle) {
+            idle.push_back(std::move(c));
         }
+    }
 
-        creq.setBody(req.Body);
-        creq.perform("POST", req.URL);
-        resp->Code = creq.respCode;
-        resp->Message = creq.respMessage;
-        resp->Body = creq.respData;
+    std::unique_ptr<Response> HandlerCurl::Handle(const Request& req)
+    {
+        auto c = acquire();
+
+        // If the request fails, the connection is closed.  An HTTP error
+        // status is not a failure here: it is returned, headers and all,
+        // and the connection is kept.
+        c->setHeaders(req);
+        c->perform(req.URL, req.Body);
+        auto resp = c->response();
+        release(std::move(c));
 
         return resp;
     }
 
+    void HandlerCurl::Prewarm(const std::string& url)
+    {
+        auto c = acquire();
+        c->warm(url);
+        release(std::move(c));
+    }
+
+    // loop drives every asynchronous request of a HandlerCurlMulti
+    // through a single multi handle, from a thread of its own.  Requests
+    // are handed over through pending, and libcurl is woken to start them.
+    class HandlerCurlMulti::loop {
+    public:
+        loop(HandlerCurlMulti* owner)
+        {
+            this->owner = owner;
+            this->stopping = false;
+            if ((this->multi = curl_multi_init()) == NULL) {
+                throw std::bad_alloc();
+            }
+            curl_multi_setopt(this->multi, CURLMOPT_MAXCONNECTS, (long)owner->MaxIdle);
+            this->thr = std::thread(&loop::run, this);
+        }
+        ~loop()
+        {
+            {
+                std::lock_guard<std::mutex> l(lk);
+                stopping = true;
+            }
+            wake();
+            thr.join();
+            curl_multi_cleanup(this->multi);
+        }
+
+        void submit(Request req, Completion done)
+        {
+            auto t = std::unique_ptr<transfer>(new transfer());
+            t->req = std::move(req);
+            t->done = std::move(done);
+            {
+                std::lock_guard<std::mutex> l(lk);
+                pending.push_back(std::move(t));
+            }
+            wake();
+        }
+
+    private:
+        struct transfer {
+            Request req;
+            Completion done;
+            std::unique_ptr<conn> c;
+        };
+
+        void wake()
+        {
+#if LIBCURL_VERSION_NUM >= 0x074400
+            curl_multi_wakeup(this->multi);
+#endif
+        }
+
+        // complete reports the outcome, and recycles the connection if it
+        // is still good.  Completions run on the loop thread, without any
+        // lock held.
+        void complete(std::unique_ptr<transfer> t, CURLcode result)
+        {
+            std::unique_ptr<Response> resp;
+            try {
+                t->c->finish(result);
+                resp = t->c->response();
+            } catch (...) {
+                t->done(nullptr, std::current_exception());
+                return;
+            }
+            owner->release(std::move(t->c));
+            t->done(std::move(resp), nullptr);
+        }
+
+        void run()
+        {
+            std::map<CURL*, std::unique_ptr<transfer>> active;
+
+            for (;;) {
+                std::deque<std::unique_ptr<transfer>> starting;
+                {
+                    std::lock_guard<std::mutex> l(lk);
+                    if (stopping) {
+                        break;
+                    }
+                    starting.swap(pending);
+                }
+
+                for (auto& t : starting) {
+                    try {
+                        t->c = owner->acquire();
+                        t->c->setHeaders(t->req);
+                        t->c->prepare(t->req.URL, t->req.Body);
+                        if (curl_multi_add_handle(multi, t->c->handle()) != CURLM_OK) {
+                            throw std::bad_alloc();
+                        }
+                    } catch (...) {
+                        t->done(nullptr, std::current_exception());
+                        continue;
+                    }
+                    auto h = t->c->handle();
+                    active[h] = std::move(t);
+                }
+
+                int running;
+                curl_multi_perform(multi, &running);
+
+                CURLMsg* msg;
+                int left;
+                while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+                    if (msg->msg != CURLMSG_DONE) {
+                        continue;
+                    }
+                    auto h = msg->easy_handle;
+                    auto result = msg->data.result;
+                    curl_multi_remove_handle(multi, h);
+                    auto it = active.find(h);
+                    auto t = std::move(it->second);
+                    active.erase(it);
+                    complete(std::move(t), result);
+                }
+
+#if LIBCURL_VERSION_NUM >= 0x074400
+                curl_multi_poll(multi, NULL, 0, 1000, NULL);
+#else
+                // Without curl_multi_wakeup, we have to look for new
+                // requests periodically.
+                curl_multi_wait(multi, NULL, 0, 10, NULL);
+#endif
+            }
+
+            // Anything still outstanding is abandoned, but its owner is
+            // still told.
+            for (auto& item : active) {
+                curl_multi_remove_handle(multi, item.first);
+                item.second->c.reset();
+                item.second->done(nullptr, std::make_exception_ptr(Error(0, "Handler destroyed")));
+            }
+            std::deque<std::unique_ptr<transfer>> left;
+            {
+                std::lock_guard<std::mutex> l(lk);
+                left.swap(pending);
+            }
+            for (auto& t : left) {
+                t->done(nullptr, std::make_exception_ptr(Error(0, "Handler destroyed")));
+            }
+        }
+
+        HandlerCurlMulti* owner;
+        CURLM* multi;
+        std::mutex lk;
+        std::deque<std::unique_ptr<transfer>> pending;
+        bool stopping;
+        std::thread thr;
+    };
+
+    HandlerCurlMulti::HandlerCurlMulti()
+    {
+        events = std::unique_ptr<loop>(new loop(this));
+    }
+
+    HandlerCurlMulti::~HandlerCurlMulti()
+    {
+        // Stop the loop while the pool it uses still exists.
+        events.reset();
+    }
+
+    void HandlerCurlMulti::HandleAsync(Request req, Completion done)
+    {
+        events->submit(std::move(req), std::move(done));
+    }
+
 } // namespace http
 } // namespace segment
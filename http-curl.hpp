@@ -10,24 +10,95 @@
 #ifndef SEGMENT_HTTP_CURL_HPP_
 #define SEGMENT_HTTP_CURL_HPP_
 
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
 #include "http.hpp"
 
 namespace segment {
 namespace http {
 
     /// HandlerCurl is an implementation of the Handler API
-    /// based on libcurl.  At present it only supports POST, and it
-    /// does not actually populate the response fields or data, since
-    /// they are not used by the framework.
+    /// based on libcurl.  At present it only supports POST.  Responses
+    /// are returned whatever their status, with their headers, reason
+    /// phrase and body; only a request that gets no response at all
+    /// throws.
+    ///
+    /// Connections are kept open between requests, so that successive
+    /// batches do not each pay for a TCP connect and a TLS handshake.
+    /// TLS sessions and DNS lookups are shared by all connections of a
+    /// handler.  Handle may be called from several threads at once;
+    /// each concurrent call uses a connection of its own.
     class HandlerCurl : public Handler {
 
     public:
-        HandlerCurl(){};
-        ~HandlerCurl(){};
+        HandlerCurl();
+        ~HandlerCurl();
         std::unique_ptr<Response> Handle(const Request& req);
+        bool SharesHeaders() const { return true; }
+
+        /// Prewarm looks up the host and connects to it (completing the
+        /// TLS handshake), with a HEAD request, and keeps the connection
+        /// for the next request.  HandlerCurlMulti keeps connections of
+        /// its own, but still starts with the host already looked up and
+        /// a TLS session that it can resume.
+        void Prewarm(const std::string& url);
+
+        /// Reuse keeps connections open for later requests.  When false,
+        /// every request is made on a fresh connection, as earlier releases
+        /// did.  Defaults to true.
+        bool Reuse;
+
+        /// MaxIdle is the most connections kept open while not in use.
+        /// It should be at least the number of batches sent at once.
+        /// Defaults to 4.
+        size_t MaxIdle;
+
+        /// CAInfo names a file of PEM certificates used to verify the
+        /// server, in place of the system default.  Empty by default.
+        std::string CAInfo;
+
+        /// DNSCacheTimeout is how long a host lookup is remembered, and
+        /// shared by all connections, before it is made again.  Negative
+        /// means forever.  Defaults to five minutes.
+        std::chrono::seconds DNSCacheTimeout;
+
+    protected:
+        class conn;
+        class shared;
+
+        std::unique_ptr<conn> acquire();
+        void release(std::unique_ptr<conn> c);
+
+    private:
+        std::mutex lk;
+        std::unique_ptr<shared> share;
+        std::vector<std::unique_ptr<conn>> idle;
+    };
+
+    /// HandlerCurlMulti is a HandlerCurl whose HandleAsync does not wait.
+    /// One event loop thread drives every request through libcurl's multi
+    /// interface, so any number of batches can be in flight at once without
+    /// a thread for each.  Requests to the same host share connections
+    /// (over HTTP/2, a single multiplexed one).  Handle still works just as
+    /// it does for HandlerCurl.
+    class HandlerCurlMulti : public HandlerCurl {
+
+    public:
+        HandlerCurlMulti();
+        ~HandlerCurlMulti();
+        void HandleAsync(Request req, Completion done);
+        bool Async() const { return true; }
+
+    private:
+        class loop;
+        std::unique_ptr<loop> events;
     };
 
 } // namespace http
 } // namespace segment
 
-#endif // SEGMENT_HTTP_CURL_HPP_
\ No newline at end of file
+#endif // SEGMENT_HTTP_CURL_HPP_
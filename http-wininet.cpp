@@ -106,7 +106,13 @@ namespace http {
             goto fail;
         }
 
-        for (auto h : req.Headers) {
+        if ((req.Common != nullptr) && !req.Common->Text.empty()) {
+            if (!HttpAddRequestHeadersA(request, req.Common->Text.c_str(), (DWORD)req.Common->Text.length(),
+                    HTTP_ADDREQ_FLAG_ADD | HTTP_ADDREQ_FLAG_REPLACE)) {
+                goto fail;
+            }
+        }
+        for (auto const& h : req.Headers) {
             std::string hdr = h.first + ": " + h.second + "\r\n";
             if (!HttpAddRequestHeadersA(request, hdr.c_str(), -1,
                     HTTP_ADDREQ_FLAG_ADD | HTTP_ADDREQ_FLAG_REPLACE)) {
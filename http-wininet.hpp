@@ -26,6 +26,7 @@ namespace http {
         HandlerWinInet(){};
         virtual ~HandlerWinInet(){};
         virtual std::unique_ptr<Response> Handle(const Request& req);
+        virtual bool SharesHeaders() const { return true; }
     };
 
 } // namespace http
@@ -8,9 +8,11 @@
 //
 
 #include <exception>
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 #ifndef SEGMENT_HTTP_HPP_
 #define SEGMENT_HTTP_HPP_
@@ -55,6 +57,32 @@ namespace http {
         std::string msg;
     };
 
+    /// HeaderBlock is a set of request headers shared by many requests,
+    /// and rendered just once.  A block is never changed after it is made
+    /// (a new one is made instead), so a transport may cache anything it
+    /// derives from one, keyed on its address, for as long as it holds a
+    /// reference to it.
+    class HeaderBlock {
+    public:
+        /// Constructor.
+        /// @param headers [in] The headers, by name.
+        HeaderBlock(const std::map<std::string, std::string>& headers)
+        {
+            for (auto const& item : headers) {
+                std::string line = item.first + ": " + item.second;
+                Text += line + "\r\n";
+                Lines.push_back(std::move(line));
+            }
+        }
+
+        /// Lines holds each header as "Key: value".
+        std::vector<std::string> Lines;
+
+        /// Text holds all of the headers, each followed by CRLF, as they
+        /// appear on the wire.
+        std::string Text;
+    };
+
     /// Request models an HTTP request, such as a POST.  In fact, as of
     /// this writing, only POST is supported, as it is all that the existing
     /// analytics framework requires.
@@ -75,10 +103,22 @@ namespace http {
         /// that we can give them a nice familiar API (STL maps).
         std::map<std::string, std::string> Headers;
 
+        /// Common holds headers that are the same for many requests, already
+        /// rendered.  These are sent in addition to Headers.  It is only set
+        /// for a Handler whose SharesHeaders returns true; other handlers
+        /// find every header in Headers.
+        std::shared_ptr<const HeaderBlock> Common;
+
         /// The request body is here.  Normally this will be something like
         /// serialized JSON.  This will generally be reasonably small, and
         /// never larger than about 512k as Segment prohibits uploading
         /// more data than that in a single POST.
+        ///
+        /// Analytics builds each body in one buffer, and moves it (never
+        /// copies it) into the Request, and from there into HandleAsync.
+        /// Handlers should send it in place, rather than taking a copy;
+        /// an asynchronous handler can move the whole Request to keep the
+        /// buffer alive until the request is done.
         std::string Body;
     };
 
@@ -97,9 +137,10 @@ namespace http {
         /// even "Out of memory").
         std::string Message;
 
-        /// Headers are the response headers we got back from the server.
-        /// Nothing in the current code actually cares about this.  The
-        /// implementation may not actually fill this in as a result.
+        /// Headers are the response headers we got back from the server,
+        /// with their names as the server sent them.  Analytics looks for
+        /// Retry-After (in any case) on failed requests; nothing else is
+        /// used at present.
         std::map<std::string, std::string> Headers;
 
         /// Body is the response body, if a payload was returned.
@@ -124,6 +165,50 @@ namespace http {
         /// @param [in] req The HTTP request object.
         /// @return The HTTP response object.
         virtual std::unique_ptr<Response> Handle(const Request& req) = 0;
+
+        /// Completion receives the outcome of an asynchronous request.
+        /// Exactly one of the arguments is set: the response, or the
+        /// exception that Handle would have thrown.
+        typedef std::function<void(std::unique_ptr<Response>, std::exception_ptr)> Completion;
+
+        /// HandleAsync starts a request, and calls done exactly once when
+        /// it completes.  done may be called from any thread, including
+        /// the caller's before HandleAsync returns, so it must not expect
+        /// to take locks that the caller holds.  The default implementation
+        /// simply calls Handle.
+        /// @param [in] req The HTTP request object.
+        /// @param [in] done Called with the result.
+        virtual void HandleAsync(Request req, Completion done)
+        {
+            std::unique_ptr<Response> resp;
+            try {
+                resp = Handle(req);
+            } catch (...) {
+                done(nullptr, std::current_exception());
+                return;
+            }
+            done(std::move(resp), nullptr);
+        }
+
+        /// Async is true for handlers whose HandleAsync returns without
+        /// waiting for the request to complete.  A caller with many
+        /// requests to make can then have them all in flight from a single
+        /// thread, rather than needing a thread for each.
+        virtual bool Async() const { return false; }
+
+        /// SharesHeaders is true for handlers that send Request::Common.
+        /// Headers that do not change from one request to the next are then
+        /// rendered once, instead of being built into Headers every time.
+        virtual bool SharesHeaders() const { return false; }
+
+        /// Prewarm gets ready to send requests to url, without sending one:
+        /// for example by looking up the host, and connecting to it, so
+        /// that the first real request need not wait for that.  It may
+        /// block, and is called from a background thread.  Failures are
+        /// not reported; the first request simply finds nothing ready.
+        /// The default implementation does nothing.
+        /// @param [in] url The URL that requests will be sent to.
+        virtual void Prewarm(const std::string& url) { (void)url; }
     };
 
 } // namespace http
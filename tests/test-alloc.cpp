@@ -0,0 +1,261 @@
+//
+// Copyright 2017 Segment Inc. <friends@segment.com>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// These tests count heap allocations, to check that data is moved
+// through the library rather than copied.  They replace the global
+// operator new, so they live in a program of their own.
+
+#include "analytics.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+using namespace segment::analytics;
+
+// Allocations of at least this size are counted while counting is on.
+// Serialized events are far smaller; batch bodies are far larger.
+static const size_t largeAlloc = 8 * 1024;
+static std::atomic<bool> counting(false);
+static std::atomic<int> largeAllocs(0);
+
+// Every allocation made by the current thread is counted while it sets
+// countingHere.
+static thread_local bool countingHere = false;
+static thread_local int threadAllocs = 0;
+
+void* operator new(size_t n)
+{
+    if (counting && (n >= largeAlloc)) {
+        largeAllocs++;
+    }
+    if (countingHere) {
+        threadAllocs++;
+    }
+    void* p = std::malloc(n == 0 ? 1 : n);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+// sink accepts every request, noting the size of each body without
+// copying it.  If async is set, it takes the request over, as an
+// asynchronous transport would, before completing it.
+class sink : public segment::http::Handler {
+public:
+    sink(bool async)
+        : async(async)
+    {
+    }
+
+    std::unique_ptr<segment::http::Response> Handle(const segment::http::Request& req)
+    {
+        std::lock_guard<std::mutex> l(lk);
+        sizes.push_back(req.Body.size());
+        auto resp = std::unique_ptr<segment::http::Response>(new segment::http::Response());
+        resp->Code = 200;
+        return resp;
+    }
+
+    void HandleAsync(segment::http::Request req, Completion done)
+    {
+        held.push_back(std::move(req));
+        done(Handle(held.back()), nullptr);
+    }
+
+    bool Async() const { return async; }
+
+    std::mutex lk;
+    std::vector<size_t> sizes;
+    std::vector<segment::http::Request> held;
+
+private:
+    bool async;
+};
+
+static void sendBatches(std::shared_ptr<sink> handler)
+{
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = handler;
+    analytics.FlushCount = 50;
+    analytics.FlushInterval = std::chrono::seconds(3600);
+
+    largeAllocs = 0;
+    counting = true;
+    for (int i = 0; i < 200; i++) {
+        analytics.Track("user" + std::to_string(i), "Allocated", { { "pad", std::string(500, 'x') } });
+    }
+    analytics.FlushWait();
+    counting = false;
+}
+
+TEST_CASE("Each batch body is allocated once", "[alloc]")
+{
+    SECTION("synchronous handler")
+    {
+        auto handler = std::make_shared<sink>(false);
+        sendBatches(handler);
+        REQUIRE(handler->sizes.size() == 4);
+        REQUIRE(handler->sizes[0] > 50 * 500);
+        REQUIRE(largeAllocs == 4);
+    }
+
+    SECTION("asynchronous handler")
+    {
+        auto handler = std::make_shared<sink>(true);
+        handler->held.reserve(4);
+        sendBatches(handler);
+        REQUIRE(handler->sizes.size() == 4);
+        REQUIRE(largeAllocs == 4);
+    }
+}
+
+// These count heap allocations, which can show that nothing is copied
+// only while Object allocates from the heap.  Pooled copies never reach
+// it, so the check is left out of builds with SEGMENT_POOL_JSON.
+#ifndef SEGMENT_POOL_JSON
+
+// A properties object of many nodes, whose keys and values need no heap
+// of their own; copying it costs at least one allocation per key.
+static Object bigProperties()
+{
+    Object props;
+    for (int i = 0; i < 500; i++) {
+        props["k" + std::to_string(i)] = i;
+    }
+    return props;
+}
+
+// Count the allocations made by this thread while running f.
+template <typename F>
+static int allocations(F f)
+{
+    threadAllocs = 0;
+    countingHere = true;
+    f();
+    countingHere = false;
+    return threadAllocs;
+}
+
+TEST_CASE("Posting never copies what it is given", "[alloc]")
+{
+    auto handler = std::make_shared<sink>(false);
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = handler;
+    auto props = bigProperties();
+    auto copy = allocations([&]() { Object dup(props); });
+    REQUIRE(copy >= 500);
+
+    // Serializing the event costs a handful of allocations, whatever its
+    // size; a copy would cost hundreds.
+    SECTION("Track")
+    {
+        REQUIRE(allocations([&]() { analytics.Track("user", "Big", props); }) < 50);
+        REQUIRE(allocations([&]() { analytics.Identify("user", props); }) < 50);
+        REQUIRE(allocations([&]() { analytics.Group("group", props); }) < 50);
+    }
+
+    SECTION("Create and post")
+    {
+        REQUIRE(allocations([&]() { analytics.CreateTrackEvent("Big", "user", props); }) >= copy);
+        Event ev;
+        REQUIRE(allocations([&]() { ev = analytics.CreateTrackEvent("Big", "user", std::move(props)); }) < 20);
+        REQUIRE(ev["properties"].size() == 500);
+        REQUIRE(allocations([&]() { analytics.PostEvent(ev); }) < 50);
+        REQUIRE(ev["properties"].size() == 500);
+        REQUIRE(allocations([&]() { analytics.PostEvent(std::move(ev)); }) < 50);
+        REQUIRE(ev.is_null());
+    }
+    analytics.FlushWait();
+}
+
+#endif // SEGMENT_POOL_JSON
+
+typedef nlohmann::basic_json<std::map, std::vector, std::string, bool,
+    std::int64_t, std::uint64_t, double, PoolAllocator>
+    pooled;
+
+// A small tree, whose strings all fit in place (no heap of their own).
+template <typename J>
+static J smallTree(int n)
+{
+    J j;
+    j["type"] = "track";
+    j["event"] = "Pooled";
+    j["n"] = n;
+    j["list"] = { 1, 2.5, "three", nullptr, true };
+    j["nested"]["ok"] = false;
+    return j;
+}
+
+TEST_CASE("Pooled trees reuse their memory", "[alloc]")
+{
+    REQUIRE(smallTree<pooled>(1).dump() == smallTree<nlohmann::json>(1).dump());
+    REQUIRE(pooled::parse(smallTree<nlohmann::json>(2).dump()) == smallTree<pooled>(2));
+
+    // Once the pool has blocks, building and tearing down trees does not
+    // touch the heap; the same trees from the heap allocate every node.
+    {
+        std::vector<pooled> warm(100, smallTree<pooled>(0));
+    }
+    threadAllocs = 0;
+    countingHere = true;
+    for (int i = 0; i < 100; i++) {
+        auto j = smallTree<pooled>(i);
+    }
+    countingHere = false;
+    REQUIRE(threadAllocs == 0);
+
+    countingHere = true;
+    for (int i = 0; i < 100; i++) {
+        auto j = smallTree<nlohmann::json>(i);
+    }
+    countingHere = false;
+    REQUIRE(threadAllocs > 100);
+
+    // Trees may be freed by a thread other than the one that made them,
+    // and threads may come and go.
+    std::vector<pooled> made;
+    for (int i = 0; i < 1000; i++) {
+        made.push_back(smallTree<pooled>(i));
+    }
+    int wrong = 0;
+    std::thread([&made, &wrong]() {
+        made.clear();
+        for (int i = 0; i < 1000; i++) {
+            if (smallTree<pooled>(i)["n"] != i) {
+                wrong++;
+            }
+        }
+    }).join();
+    REQUIRE(wrong == 0);
+    for (int i = 0; i < 1000; i++) {
+        made.push_back(smallTree<pooled>(i));
+    }
+    REQUIRE(made[999]["n"] == 999);
+
+    // Large blocks come from the heap.
+    auto big = PoolAlloc(4096);
+    auto small = PoolAlloc(24);
+    REQUIRE(big != small);
+    PoolFree(big, 4096);
+    PoolFree(small, 24);
+}
@@ -0,0 +1,1497 @@
+//
+// Copyright 2017 Segment Inc. <friends@segment.com>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// These tests exercise batching and queueing, using a local transport
+// that records what it is asked to send.  They need no network access.
+
+#include "analytics.hpp"
+#include "date.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#ifdef SEGMENT_USE_ZLIB
+#include <cstring>
+#include <zlib.h>
+#endif
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+using namespace segment::analytics;
+using json = segment::analytics::Object;
+
+class recorder : public segment::http::Handler {
+public:
+    std::unique_ptr<segment::http::Response> Handle(const segment::http::Request& req)
+    {
+        std::lock_guard<std::mutex> l(lk);
+        bodies.push_back(req.Body);
+        auto enc = req.Headers.find("Content-Encoding");
+        encodings.push_back(enc == req.Headers.end() ? "" : enc->second);
+        auto agent = req.Headers.find("User-Agent");
+        agents.push_back(agent == req.Headers.end() ? "" : agent->second);
+        auto resp = std::unique_ptr<segment::http::Response>(new segment::http::Response());
+        resp->Code = 200;
+        return resp;
+    }
+
+    std::vector<std::string> Bodies()
+    {
+        std::lock_guard<std::mutex> l(lk);
+        return bodies;
+    }
+
+    std::vector<std::string> Encodings()
+    {
+        std::lock_guard<std::mutex> l(lk);
+        return encodings;
+    }
+
+    std::vector<std::string> Agents()
+    {
+        std::lock_guard<std::mutex> l(lk);
+        return agents;
+    }
+
+private:
+    std::mutex lk;
+    std::vector<std::string> bodies;
+    std::vector<std::string> encodings;
+    std::vector<std::string> agents;
+};
+
+class counter : public Callback {
+public:
+    counter()
+        : success(0)
+        , fail(0)
+    {
+    }
+
+    void Success(const Event&)
+    {
+        std::lock_guard<std::mutex> l(lk);
+        success++;
+        cv.notify_all();
+    }
+
+    void Failure(const Event&, const std::string& reason)
+    {
+        std::lock_guard<std::mutex> l(lk);
+        last_reason = reason;
+        fail++;
+        cv.notify_all();
+    }
+
+    void Wait(int num)
+    {
+        std::unique_lock<std::mutex> l(lk);
+        while (success + fail < num) {
+            cv.wait(l);
+        }
+    }
+
+    std::mutex lk;
+    std::condition_variable cv;
+    int success;
+    int fail;
+    std::string last_reason;
+};
+
+TEST_CASE("Batches respect FlushSize", "[batch]")
+{
+    auto handler = std::make_shared<recorder>();
+    auto cb = std::make_shared<counter>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = handler;
+    analytics.Callback = cb;
+    analytics.MaxRetries = 0;
+    analytics.FlushInterval = std::chrono::seconds(1);
+    analytics.FlushSize = 1024;
+
+    for (int i = 0; i < 40; i++) {
+        analytics.Track("user" + std::to_string(i), "Sized", { { "pad", std::string(50, 'x') } });
+    }
+    analytics.Flush();
+    cb->Wait(40);
+    REQUIRE(cb->success == 40);
+
+    size_t total = 0;
+    auto bodies = handler->Bodies();
+    REQUIRE(bodies.size() > 1);
+    for (auto const& body : bodies) {
+        auto j = json::parse(body);
+        // Only the batch itself counts toward the limit.
+        json b;
+        b["batch"] = j["batch"];
+        REQUIRE(b.dump().size() < 1024);
+        total += j["batch"].size();
+    }
+    REQUIRE(total == 40);
+}
+
+TEST_CASE("An oversized event is sent alone", "[batch]")
+{
+    auto handler = std::make_shared<recorder>();
+    auto cb = std::make_shared<counter>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = handler;
+    analytics.Callback = cb;
+    analytics.MaxRetries = 0;
+    analytics.FlushInterval = std::chrono::seconds(1);
+    analytics.FlushSize = 256;
+
+    analytics.Track("small", "Before");
+    analytics.Track("large", "Huge", { { "pad", std::string(1000, 'x') } });
+    analytics.Track("small", "After");
+    analytics.Flush();
+    cb->Wait(3);
+    REQUIRE(cb->success == 3);
+
+    auto bodies = handler->Bodies();
+    REQUIRE(bodies.size() == 3);
+    for (auto const& body : bodies) {
+        REQUIRE(json::parse(body)["batch"].size() == 1);
+    }
+}
+
+TEST_CASE("Batch bodies carry the envelope", "[batch]")
+{
+    auto handler = std::make_shared<recorder>();
+    auto cb = std::make_shared<counter>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = handler;
+    analytics.Callback = cb;
+    analytics.FlushCount = 2;
+    analytics.Integrations = { { "All", false } };
+
+    analytics.Track("envelope1", "First", { { "n", 1 } });
+    analytics.Track("envelope2", "Second", { { "n", 2 } });
+    cb->Wait(2);
+    REQUIRE(cb->success == 2);
+
+    auto bodies = handler->Bodies();
+    REQUIRE(bodies.size() == 1);
+    auto j = json::parse(bodies[0]);
+    REQUIRE(j["batch"].size() == 2);
+    REQUIRE(j["batch"][0]["userId"] == "envelope1");
+    REQUIRE(j["batch"][1]["properties"]["n"] == 2);
+    REQUIRE(j["context"]["library"]["name"] == "analytics-cpp");
+    REQUIRE(j["integrations"]["All"] == false);
+    REQUIRE(j["sentAt"].is_string());
+}
+
+TEST_CASE("The envelope changes only through its setters", "[batch]")
+{
+    auto handler = std::make_shared<recorder>();
+    auto cb = std::make_shared<counter>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = handler;
+    analytics.Callback = cb;
+    analytics.FlushCount = 1;
+
+    analytics.Track("user", "First");
+    cb->Wait(1);
+    analytics.SetIntegrations({ { "All", false } });
+    analytics.Track("user", "Second");
+    cb->Wait(2);
+    analytics.SetContext({ { "library", { { "name", "custom" }, { "version", "2.0" } } } });
+    analytics.Track("user", "Third");
+    cb->Wait(3);
+    REQUIRE(cb->success == 3);
+
+    auto bodies = handler->Bodies();
+    auto agents = handler->Agents();
+    REQUIRE(bodies.size() == 3);
+    auto first = json::parse(bodies[0]);
+    auto second = json::parse(bodies[1]);
+    auto third = json::parse(bodies[2]);
+    REQUIRE(first["context"]["library"]["name"] == "analytics-cpp");
+    REQUIRE(first.count("integrations") == 0);
+    REQUIRE(agents[0].find("analytics-cpp/") == 0);
+    REQUIRE(second["context"] == first["context"]);
+    REQUIRE(second["integrations"]["All"] == false);
+    REQUIRE(agents[1] == agents[0]);
+    REQUIRE(third["context"]["library"]["name"] == "custom");
+    REQUIRE(third["integrations"]["All"] == false);
+    REQUIRE(agents[2] == "custom/2.0");
+}
+
+TEST_CASE("A malformed context does not stop the sender", "[batch]")
+{
+    auto handler = std::make_shared<recorder>();
+    auto cb = std::make_shared<counter>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = handler;
+    analytics.Callback = cb;
+
+    analytics.SetContext({ { "library", "bad" } });
+    analytics.Track("user", "First");
+    analytics.FlushWait();
+    analytics.SetContext({ { "library", { { "name", 7 } } } });
+    analytics.Track("user", "Second");
+    analytics.FlushWait();
+    REQUIRE(cb->success == 2);
+
+    auto agents = handler->Agents();
+    REQUIRE(agents.size() == 2);
+    REQUIRE(agents[0] == "null/null");
+    REQUIRE(agents[1] == "7/null");
+}
+
+TEST_CASE("Every event on the wire carries sentAt", "[batch]")
+{
+    auto handler = std::make_shared<recorder>();
+    auto cb = std::make_shared<counter>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = handler;
+    analytics.Callback = cb;
+    analytics.FlushCount = 5;
+
+    Event own = analytics.CreateTrackEvent("Own", "user");
+    own["sentAt"] = "2001-02-03T04:05:06.789Z";
+    analytics.Track("user", "Stamped");
+    analytics.PostEvent(Event::object());
+    analytics.PostEvent(own);
+    analytics.Identify("user", { { "sentAt", "trait" } });
+    analytics.PostEvent(analytics.CreateTrackEvent("Nested", "user", { { "sentAt", "property" } }));
+    cb->Wait(5);
+    REQUIRE(cb->success == 5);
+
+    auto bodies = handler->Bodies();
+    REQUIRE(bodies.size() == 1);
+    auto j = json::parse(bodies[0]);
+    auto sentAt = j["sentAt"].get<std::string>();
+    REQUIRE(sentAt.size() == 24);
+    REQUIRE(j["batch"].size() == 5);
+    REQUIRE(j["batch"][0]["sentAt"] == sentAt);
+    REQUIRE(j["batch"][0]["event"] == "Stamped");
+    REQUIRE(j["batch"][1] == json({ { "sentAt", sentAt } }));
+    REQUIRE(j["batch"][2]["sentAt"] == "2001-02-03T04:05:06.789Z");
+    REQUIRE(bodies[0].find("\"sentAt\":\"2001-02-03T04:05:06.789Z\"") != std::string::npos);
+    // Only a sentAt at the top level is the event's own.
+    REQUIRE(j["batch"][3]["sentAt"] == sentAt);
+    REQUIRE(j["batch"][3]["traits"]["sentAt"] == "trait");
+    REQUIRE(j["batch"][4]["sentAt"] == sentAt);
+    REQUIRE(j["batch"][4]["properties"]["sentAt"] == "property");
+}
+
+TEST_CASE("Events are written as Event::dump would write them", "[batch]")
+{
+    auto handler = std::make_shared<recorder>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = handler;
+    analytics.FlushCount = 1;
+
+    std::string odd = "quote\" back\\ \b\f\n\r\t \x01\x1f \x7f caf\xc3\xa9 /";
+    Object props = { { "n", 1 }, { odd, odd } };
+    Object ctx = { { "ip", "127.0.0.1" } };
+    Object integ = { { "All", false } };
+
+    std::vector<Event> expect;
+    analytics.Track(odd, "anon", "Tracked", props, ctx, integ);
+    expect.push_back(analytics.CreateTrackEvent("Tracked", odd, props));
+    analytics.Identify("user", "", props, nullptr, integ);
+    expect.push_back(analytics.CreateIdentifyEvent("user", props));
+    analytics.Page(odd, "user", "", nullptr, ctx, nullptr);
+    expect.push_back(analytics.CreatePageEvent(odd, "user"));
+    analytics.Screen("Home", "", "anon", props, nullptr, nullptr);
+    expect.push_back(analytics.CreateScreenEvent("Home", ""));
+    analytics.Alias("before", odd, "anon", ctx, integ);
+    expect.push_back(analytics.CreateAliasEvent("before", odd));
+    analytics.Group("group", "user", "anon", props, ctx, nullptr);
+    expect.push_back(analytics.CreateGroupEvent("group", props));
+    analytics.FlushWait();
+
+    expect[0]["anonymousId"] = "anon";
+    expect[0]["context"] = ctx;
+    expect[0]["integrations"] = integ;
+    expect[1]["integrations"] = integ;
+    expect[2]["context"] = ctx;
+    expect[3]["anonymousId"] = "anon";
+    expect[3]["properties"] = props;
+    expect[4]["anonymousId"] = "anon";
+    expect[4]["context"] = ctx;
+    expect[4]["integrations"] = integ;
+    expect[5]["userId"] = "user";
+    expect[5]["anonymousId"] = "anon";
+    expect[5]["context"] = ctx;
+
+    auto bodies = handler->Bodies();
+    REQUIRE(bodies.size() == expect.size());
+    for (size_t i = 0; i < bodies.size(); i++) {
+        // Each body holds just the one event, as the queue has it, but
+        // for the sentAt stamped in front.
+        auto end = bodies[i].rfind("],\"context\":");
+        REQUIRE(end != std::string::npos);
+        auto raw = bodies[i].substr(10, end - 10);
+        auto sent = json::parse(raw);
+        expect[i]["timestamp"] = sent["timestamp"];
+        auto stamp = "{\"sentAt\":\"" + sent["sentAt"].get<std::string>() + "\",";
+        REQUIRE(raw == stamp + expect[i].dump().substr(1));
+    }
+}
+
+TEST_CASE("ToJSON writes what dump writes", "[batch]")
+{
+    // Every byte, at every offset from the sixteen byte blocks that are
+    // scanned for escapes at once, and in runs that end mid-block.
+    for (size_t len = 0; len < 40; len++) {
+        for (int c = 0; c < 256; c++) {
+            for (size_t at = 0; at < len; at += 7) {
+                std::string s(len, 'a');
+                s[at] = char(c);
+                json j = s;
+                REQUIRE(ToJSON(j) == j.dump());
+            }
+        }
+    }
+
+    const double inf = std::numeric_limits<double>::infinity();
+    json numbers = { 0, -1, 7, std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max(),
+        std::numeric_limits<uint64_t>::max(), 0.0, -0.0, 1.0, -2.5, 100.0, 0.1, 1e300, -1e-300, 1.0 / 3,
+        123456789012345678.0, inf, -inf, std::nan("") };
+    REQUIRE(ToJSON(numbers) == numbers.dump());
+
+    std::mt19937 rng(7);
+    std::function<json(int)> random = [&](int depth) -> json {
+        switch (rng() % (depth > 3 ? 5 : 7)) {
+        case 0:
+            return nullptr;
+        case 1:
+            return (rng() % 2) == 0;
+        case 2:
+            return int64_t(rng()) - int64_t(rng()) * 4096;
+        case 3:
+            return double(int(rng())) / double(rng() | 1);
+        case 4: {
+            std::string s(rng() % 48, 'x');
+            for (auto& ch : s) {
+                ch = char(rng() % 4 == 0 ? rng() % 256 : 'a' + rng() % 26);
+            }
+            return s;
+        }
+        case 5: {
+            json a = json::array();
+            for (auto n = rng() % 5; n > 0; n--) {
+                a.push_back(random(depth + 1));
+            }
+            return a;
+        }
+        default: {
+            json o = json::object();
+            for (auto n = rng() % 6; n > 0; n--) {
+                o[random(4).dump()] = random(depth + 1);
+            }
+            return o;
+        }
+        }
+    };
+    for (int i = 0; i < 2000; i++) {
+        auto j = random(0);
+        REQUIRE(ToJSON(j) == j.dump());
+    }
+}
+
+TEST_CASE("Symbols and built properties", "[batch]")
+{
+    auto handler = std::make_shared<recorder>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = handler;
+    analytics.FlushCount = 1;
+
+    std::string odd = "quote\" back\\ \n \x01 caf\xc3\xa9";
+    Symbol viewed("Product Viewed");
+    Symbol key(odd);
+    REQUIRE(Symbol(std::string("Product Viewed")) == viewed);
+    REQUIRE(Symbol("Product Added") != viewed);
+    REQUIRE(key.str() == odd);
+    REQUIRE(key.quoted() == json(odd).dump());
+    // Interning takes a lock, so it is never done behind the caller's back.
+    REQUIRE(!(std::is_convertible<const char*, Symbol>::value));
+    REQUIRE(!(std::is_convertible<std::string, Symbol>::value));
+
+    static const Symbol sku("sku"), price("price"), quantity("quantity"), count("count"), offset("offset"),
+        gift("gift"), nested("nested"), a("a"), tree("tree"), nan("nan"), inf("inf"), minus("minus");
+    Properties props;
+    REQUIRE(props.Dump() == "{}");
+    REQUIRE(props.Empty());
+    props.Set(sku, "G-1")
+        .Set(price, 19.99)
+        .Set(quantity, 3)
+        .Set(count, uint64_t(18446744073709551615ULL))
+        .Set(offset, -7L)
+        .Set(gift, false)
+        .Set(key, odd)
+        .Set(nested, Properties().Set(a, 1))
+        .Set(tree, Object({ { "b", { 1, 2 } } }));
+    REQUIRE(!props.Empty());
+
+    Object expect = {
+        { "sku", "G-1" },
+        { "price", 19.99 },
+        { "quantity", 3 },
+        { "count", uint64_t(18446744073709551615ULL) },
+        { "offset", -7 },
+        { "gift", false },
+        { odd, odd },
+        { "nested", { { "a", 1 } } },
+        { "tree", { { "b", { 1, 2 } } } },
+    };
+    REQUIRE(json::parse(props.Dump()) == expect);
+    // Members are written in the order they were set.
+    REQUIRE(props.Dump().find("\"sku\":\"G-1\",\"price\":19.99,") == 1);
+
+    // Numbers JSON cannot hold are written as Object writes them.
+    const double infinity = std::numeric_limits<double>::infinity();
+    auto nonFinite = Properties().Set(nan, std::nan("")).Set(inf, infinity).Set(minus, -infinity);
+    REQUIRE(nonFinite.Dump() == "{\"nan\":null,\"inf\":null,\"minus\":null}");
+    REQUIRE(json::parse(nonFinite.Dump()) == json({ { "nan", std::nan("") }, { "inf", infinity }, { "minus", -infinity } }));
+
+    analytics.Track("user", viewed, props);
+    analytics.Track("user", Symbol("Empty"), Properties());
+    analytics.Track("user", key, Properties());
+    analytics.FlushWait();
+
+    auto bodies = handler->Bodies();
+    REQUIRE(bodies.size() == 3);
+    auto ev = json::parse(bodies[0])["batch"][0];
+    REQUIRE(ev["type"] == "track");
+    REQUIRE(ev["event"] == "Product Viewed");
+    REQUIRE(ev["userId"] == "user");
+    REQUIRE(ev["properties"] == expect);
+    ev = json::parse(bodies[1])["batch"][0];
+    REQUIRE(ev["event"] == "Empty");
+    REQUIRE(ev["properties"] == json::object());
+    ev = json::parse(bodies[2])["batch"][0];
+    REQUIRE(ev["event"] == odd);
+}
+
+TEST_CASE("Time stamps match date::format", "[batch]")
+{
+    using namespace std::chrono;
+    auto check = [](system_clock::time_point when) {
+        return TimeStamp(when) == date::format("%FT%TZ", time_point_cast<milliseconds>(when));
+    };
+
+    // Step across seconds, days and a year end, and back before 1970,
+    // where seconds round down but milliseconds toward zero.
+    system_clock::time_point starts[] = {
+        system_clock::now(),
+        date::sys_days(date::year(2016) / 12 / 31) + hours(23) + minutes(59) + seconds(58),
+        date::sys_days(date::year(1969) / 12 / 31) + hours(23) + minutes(59) + seconds(59),
+        date::sys_days(date::year(2000) / 2 / 29),
+    };
+    for (auto start : starts) {
+        for (int i = 0; i < 3000; i += 7) {
+            REQUIRE(check(start + milliseconds(i)));
+            REQUIRE(check(start + microseconds(i * 1001 + 999)));
+            REQUIRE(check(start - milliseconds(i)));
+        }
+    }
+
+    std::minstd_rand rng(1);
+    for (int i = 0; i < 1000; i++) {
+        auto ms = milliseconds((long long)(rng()) * 1000 + rng() % 1000);
+        REQUIRE(check(system_clock::time_point(ms)));
+        REQUIRE(check(system_clock::time_point(-ms)));
+    }
+
+    // Each thread has its own cache.
+    std::atomic<int> bad(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.push_back(std::thread([&, t]() {
+            auto start = starts[t];
+            for (int i = 0; i < 5000; i++) {
+                if (!check(start + milliseconds(i * (t + 1)))) {
+                    bad++;
+                }
+            }
+        }));
+    }
+    for (auto& thr : threads) {
+        thr.join();
+    }
+    REQUIRE(bad == 0);
+}
+
+#ifdef SEGMENT_USE_ZLIB
+static std::string inflated(const std::string& body)
+{
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    // Detect either a gzip or a zlib header.
+    REQUIRE(inflateInit2(&zs, 15 + 32) == Z_OK);
+    std::string out(body.size() * 100, '\0');
+    zs.next_in = (Bytef*)body.data();
+    zs.avail_in = uInt(body.size());
+    zs.next_out = (Bytef*)&out[0];
+    zs.avail_out = uInt(out.size());
+    REQUIRE(inflate(&zs, Z_FINISH) == Z_STREAM_END);
+    out.resize(zs.total_out);
+    inflateEnd(&zs);
+    return out;
+}
+
+TEST_CASE("Batch bodies can be compressed", "[batch]")
+{
+    auto handler = std::make_shared<recorder>();
+    auto cb = std::make_shared<counter>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = handler;
+    analytics.Callback = cb;
+    analytics.FlushInterval = std::chrono::seconds(1);
+
+    SECTION("gzip")
+    {
+        analytics.Encoding = Compression::Gzip;
+        analytics.FlushCount = 20;
+        for (int i = 0; i < 20; i++) {
+            analytics.Track("gzip" + std::to_string(i), "Compressed", { { "pad", std::string(100, 'x') } });
+        }
+        cb->Wait(20);
+        auto bodies = handler->Bodies();
+        REQUIRE(bodies.size() == 1);
+        REQUIRE(handler->Encodings()[0] == "gzip");
+        REQUIRE((unsigned char)bodies[0][0] == 0x1f); // gzip magic
+        auto raw = inflated(bodies[0]);
+        REQUIRE(raw.size() > bodies[0].size() * 4);
+        auto j = json::parse(raw);
+        REQUIRE(j["batch"].size() == 20);
+        REQUIRE(j["batch"][19]["userId"] == "gzip19");
+    }
+
+    SECTION("deflate")
+    {
+        analytics.Encoding = Compression::Deflate;
+        analytics.CompressionLevel = 1;
+        analytics.FlushCount = 2;
+        analytics.Track("deflate1", "Compressed");
+        analytics.Track("deflate2", "Compressed");
+        cb->Wait(2);
+        REQUIRE(handler->Encodings()[0] == "deflate");
+        auto j = json::parse(inflated(handler->Bodies()[0]));
+        REQUIRE(j["batch"][1]["userId"] == "deflate2");
+    }
+
+    SECTION("FlushSize on compressed bytes")
+    {
+        analytics.Encoding = Compression::Gzip;
+        analytics.FlushSizeCompressed = true;
+        analytics.FlushSize = 1024;
+        for (int i = 0; i < 200; i++) {
+            analytics.Track("sized" + std::to_string(i), "Compressed", { { "pad", std::string(100, 'x') } });
+        }
+        analytics.FlushWait();
+        REQUIRE(cb->success == 200);
+
+        // Once the ratio is known, batches hold far more than FlushSize
+        // of raw data, while staying near it on the wire.
+        size_t biggest = 0;
+        for (auto const& body : handler->Bodies()) {
+            REQUIRE(body.size() < 2048);
+            biggest = std::max(biggest, inflated(body).size());
+        }
+        REQUIRE(biggest > 4096);
+    }
+}
+#endif
+
+// flaky fails the first attempts at each batch, and takes a while over
+// every request, keeping track of how many it is handling at once.
+class flaky : public segment::http::Handler {
+public:
+    flaky(int failures, std::chrono::milliseconds delay)
+        : failures(failures)
+        , delay(delay)
+        , active(0)
+        , peak(0)
+    {
+    }
+
+    std::unique_ptr<segment::http::Response> Handle(const segment::http::Request& req)
+    {
+        auto resp = std::unique_ptr<segment::http::Response>(new segment::http::Response());
+        std::string user = json::parse(req.Body)["batch"][0]["userId"];
+        {
+            std::lock_guard<std::mutex> l(lk);
+            active++;
+            peak = std::max(peak, active);
+            resp->Code = (attempts[user]++ < failures) ? 503 : 200;
+        }
+        std::this_thread::sleep_for(delay);
+        {
+            std::lock_guard<std::mutex> l(lk);
+            active--;
+        }
+        return resp;
+    }
+
+    int failures;
+    std::chrono::milliseconds delay;
+    std::mutex lk;
+    std::map<std::string, int> attempts;
+    int active;
+    int peak;
+};
+
+TEST_CASE("Several batches can be in flight", "[batch]")
+{
+    auto handler = std::make_shared<flaky>(0, std::chrono::milliseconds(200));
+    auto cb = std::make_shared<counter>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = handler;
+    analytics.Callback = cb;
+    analytics.FlushCount = 1;
+    analytics.MaxInFlight = 4;
+
+    for (int i = 0; i < 8; i++) {
+        analytics.Track("inflight" + std::to_string(i), "Concurrent");
+    }
+    // FlushWait must not return until every batch is done.
+    analytics.FlushWait();
+    REQUIRE(cb->success == 8);
+    REQUIRE(handler->peak > 1);
+    REQUIRE(handler->peak <= 4);
+}
+
+TEST_CASE("Retries are counted per batch", "[batch]")
+{
+    auto handler = std::make_shared<flaky>(2, std::chrono::milliseconds(0));
+    auto cb = std::make_shared<counter>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = handler;
+    analytics.Callback = cb;
+    analytics.FlushCount = 1;
+    analytics.MaxRetries = 2;
+    analytics.MaxInFlight = 2;
+
+    analytics.Track("retry1", "Flaky");
+    analytics.Track("retry2", "Flaky");
+    analytics.FlushWait();
+    REQUIRE(cb->success == 2);
+    REQUIRE(cb->fail == 0);
+    REQUIRE(handler->attempts["retry1"] == 3);
+    REQUIRE(handler->attempts["retry2"] == 3);
+}
+
+// deferred is an asynchronous handler.  It completes requests from a
+// thread of its own, after a delay, failing each user's first attempt.
+class deferred : public segment::http::Handler {
+public:
+    deferred()
+        : peak(0)
+        , stop(false)
+    {
+        thr = std::thread([this]() {
+            std::unique_lock<std::mutex> l(lk);
+            while (!stop || !pending.empty()) {
+                if (pending.empty()) {
+                    cv.wait(l);
+                    continue;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                auto work = std::move(pending);
+                pending.clear();
+                l.unlock();
+                for (auto& done : work) {
+                    done();
+                }
+                l.lock();
+            }
+        });
+    }
+    ~deferred()
+    {
+        {
+            std::lock_guard<std::mutex> l(lk);
+            stop = true;
+            cv.notify_all();
+        }
+        thr.join();
+    }
+
+    std::unique_ptr<segment::http::Response> Handle(const segment::http::Request&)
+    {
+        throw std::logic_error("Handle should not be used");
+    }
+
+    void HandleAsync(segment::http::Request req, Completion done)
+    {
+        std::string user = json::parse(req.Body)["batch"][0]["userId"];
+        std::lock_guard<std::mutex> l(lk);
+        callers.insert(std::this_thread::get_id());
+        bool fail = (attempts[user]++ == 0);
+        pending.push_back([done, fail]() {
+            if (fail) {
+                done(nullptr, std::make_exception_ptr(segment::http::Error(503)));
+                return;
+            }
+            auto resp = std::unique_ptr<segment::http::Response>(new segment::http::Response());
+            resp->Code = 200;
+            done(std::move(resp), nullptr);
+        });
+        peak = std::max(peak, pending.size());
+        cv.notify_all();
+    }
+
+    bool Async() const { return true; }
+
+    std::mutex lk;
+    std::map<std::string, int> attempts;
+    std::set<std::thread::id> callers;
+    size_t peak;
+
+private:
+    std::condition_variable cv;
+    std::vector<std::function<void()>> pending;
+    bool stop;
+    std::thread thr;
+};
+
+TEST_CASE("Asynchronous handlers need only one sender", "[batch]")
+{
+    auto handler = std::make_shared<deferred>();
+    auto cb = std::make_shared<counter>();
+    {
+        Analytics analytics("writeKey", "http://localhost");
+        analytics.Handler = handler;
+        analytics.Callback = cb;
+        analytics.FlushCount = 1;
+        analytics.MaxRetries = 1;
+        analytics.Retry->BaseDelay = std::chrono::milliseconds(0);
+        analytics.MaxInFlight = 32;
+
+        for (int i = 0; i < 32; i++) {
+            analytics.Track("async" + std::to_string(i), "Concurrent");
+        }
+        analytics.FlushWait();
+    }
+    REQUIRE(cb->success == 32);
+    REQUIRE(cb->fail == 0);
+    REQUIRE(handler->attempts.size() == 32);
+    REQUIRE(handler->attempts["async0"] == 2);
+    REQUIRE(handler->callers.size() == 1);
+    REQUIRE(handler->peak > 1);
+    REQUIRE(handler->peak <= 32);
+}
+
+// refuser answers every request with the same status, and counts them.
+class refuser : public segment::http::Handler {
+public:
+    refuser(int code)
+        : code(code)
+        , calls(0)
+    {
+    }
+
+    std::unique_ptr<segment::http::Response> Handle(const segment::http::Request&)
+    {
+        calls++;
+        auto resp = std::unique_ptr<segment::http::Response>(new segment::http::Response());
+        resp->Code = code;
+        return resp;
+    }
+
+    int code;
+    std::atomic<int> calls;
+};
+
+TEST_CASE("Only retryable failures are retried", "[batch]")
+{
+    auto cb = std::make_shared<counter>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Callback = cb;
+    analytics.MaxRetries = 3;
+    analytics.AdaptiveRate = false;
+    analytics.Retry->BaseDelay = std::chrono::milliseconds(1);
+
+    SECTION("400 is reported at once")
+    {
+        auto handler = std::make_shared<refuser>(400);
+        analytics.Handler = handler;
+        analytics.Track("refused", "Bad");
+        analytics.FlushWait();
+        REQUIRE(cb->fail == 1);
+        REQUIRE(cb->last_reason == "HTTP Error 400");
+        REQUIRE(handler->calls == 1);
+    }
+
+    SECTION("503 is retried")
+    {
+        auto handler = std::make_shared<refuser>(503);
+        analytics.Handler = handler;
+        analytics.Track("unavailable", "Retry");
+        analytics.FlushWait();
+        REQUIRE(cb->fail == 1);
+        REQUIRE(handler->calls == 4);
+    }
+
+    SECTION("RetryInterval still sets the first wait")
+    {
+        auto handler = std::make_shared<refuser>(503);
+        analytics.Handler = handler;
+        analytics.RetryInterval = std::chrono::seconds(0);
+        analytics.Track("unavailable", "Retry");
+        analytics.FlushWait();
+        REQUIRE(analytics.Retry->BaseDelay.count() == 0);
+        REQUIRE(cb->fail == 1);
+        REQUIRE(handler->calls == 4);
+    }
+}
+
+TEST_CASE("Retry policy backs off", "[batch]")
+{
+    REQUIRE(RetryPolicy::Classify(0) == FailureKind::Network);
+    REQUIRE(RetryPolicy::Classify(408) == FailureKind::Network);
+    REQUIRE(RetryPolicy::Classify(400) == FailureKind::Malformed);
+    REQUIRE(RetryPolicy::Classify(413) == FailureKind::TooLarge);
+    REQUIRE(RetryPolicy::Classify(429) == FailureKind::Throttled);
+    REQUIRE(RetryPolicy::Classify(404) == FailureKind::Client);
+    REQUIRE(RetryPolicy::Classify(502) == FailureKind::Server);
+    REQUIRE(RetryPolicy::Classify(302) == FailureKind::Other);
+
+    RetryPolicy policy;
+    policy.BaseDelay = std::chrono::milliseconds(100);
+    policy.MaxDelay = std::chrono::milliseconds(1000);
+
+    policy.Jitter = false;
+    REQUIRE(policy.Backoff(1).count() == 100);
+    REQUIRE(policy.Backoff(2).count() == 200);
+    REQUIRE(policy.Backoff(4).count() == 800);
+    REQUIRE(policy.Backoff(5).count() == 1000);
+    REQUIRE(policy.Backoff(100).count() == 1000);
+
+    // With full jitter, waits are spread over the whole range.
+    policy.Jitter = true;
+    long long least = 1000, most = 0;
+    for (int i = 0; i < 1000; i++) {
+        long long d = policy.Backoff(3).count();
+        REQUIRE(d >= 0);
+        REQUIRE(d <= 400);
+        least = std::min(least, d);
+        most = std::max(most, d);
+    }
+    REQUIRE(least < 100);
+    REQUIRE(most > 300);
+}
+
+// scripted waits before each retry as long as it is told to: the nth
+// call to Backoff returns the nth delay.
+class scripted : public RetryPolicy {
+public:
+    scripted(std::vector<int> delays)
+        : delays(delays)
+        , next(0)
+    {
+    }
+
+    std::chrono::milliseconds Backoff(int) const
+    {
+        return std::chrono::milliseconds(delays[next++]);
+    }
+
+    std::vector<int> delays;
+    mutable std::atomic<size_t> next;
+};
+
+// firstRefusal refuses the first attempt of each user's batch, and
+// notes when each attempt was made.
+class firstRefusal : public segment::http::Handler {
+public:
+    std::unique_ptr<segment::http::Response> Handle(const segment::http::Request& req)
+    {
+        auto user = json::parse(req.Body)["batch"][0]["userId"].get<std::string>();
+        std::lock_guard<std::mutex> l(lk);
+        auto resp = std::unique_ptr<segment::http::Response>(new segment::http::Response());
+        resp->Code = seen.insert(user).second ? 503 : 200;
+        attempts.push_back(std::make_pair(user, std::chrono::steady_clock::now()));
+        return resp;
+    }
+
+    size_t Attempts()
+    {
+        std::lock_guard<std::mutex> l(lk);
+        return attempts.size();
+    }
+
+    std::mutex lk;
+    std::set<std::string> seen;
+    std::vector<std::pair<std::string, std::chrono::steady_clock::time_point>> attempts;
+};
+
+TEST_CASE("Retries are sent in deadline order", "[batch]")
+{
+    auto handler = std::make_shared<firstRefusal>();
+    auto cb = std::make_shared<counter>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = handler;
+    analytics.Callback = cb;
+    analytics.FlushCount = 1;
+    analytics.MaxInFlight = 4;
+    analytics.AdaptiveRate = false;
+    analytics.Retry = std::make_shared<scripted>(std::vector<int>{ 700, 200, 450 });
+
+    // Fail one batch at a time, so that each gets the next delay: a at
+    // about 0ms, to retry at 700; b at 50, to retry at 250; c at 100,
+    // to retry at 550.  None is retried before the last has failed.
+    const char* users[] = { "a", "b", "c" };
+    for (size_t i = 0; i < 3; i++) {
+        analytics.Track(users[i], "Retried");
+        while (handler->Attempts() < i + 1) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    cb->Wait(3);
+    REQUIRE(cb->success == 3);
+
+    auto const& attempts = handler->attempts;
+    REQUIRE(attempts.size() == 6);
+    std::vector<std::string> order;
+    std::map<std::string, std::chrono::steady_clock::time_point> failed;
+    for (size_t i = 0; i < 3; i++) {
+        REQUIRE(attempts[i].first == users[i]);
+        failed[users[i]] = attempts[i].second;
+    }
+    for (size_t i = 3; i < 6; i++) {
+        order.push_back(attempts[i].first);
+    }
+    REQUIRE(order == std::vector<std::string>({ "b", "c", "a" }));
+    REQUIRE(attempts[3].second - failed["b"] >= std::chrono::milliseconds(200));
+    REQUIRE(attempts[4].second - failed["c"] >= std::chrono::milliseconds(450));
+    REQUIRE(attempts[5].second - failed["a"] >= std::chrono::milliseconds(700));
+}
+
+TEST_CASE("The worker wakes for work rather than on a timer", "[batch]")
+{
+    auto cb = std::make_shared<counter>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = std::make_shared<recorder>();
+    analytics.Callback = cb;
+    analytics.FlushCount = 3;
+    analytics.FlushInterval = std::chrono::seconds(30);
+    auto prompt = std::chrono::seconds(2);
+
+    SECTION("a full batch is sent without waiting for FlushInterval")
+    {
+        for (int round = 1; round <= 3; round++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < 3; i++) {
+                analytics.Track("user", "Counted");
+            }
+            cb->Wait(round);
+            REQUIRE(std::chrono::steady_clock::now() - start < prompt);
+        }
+    }
+
+    SECTION("a Flush while the worker sleeps is not lost")
+    {
+        for (int round = 1; round <= 20; round++) {
+            // Vary the delay, so that some flushes land as the worker
+            // is going to sleep, and some once it is asleep.
+            analytics.Track("user", "Flushed");
+            std::this_thread::sleep_for(std::chrono::milliseconds(round % 5));
+            auto start = std::chrono::steady_clock::now();
+            analytics.Flush();
+            cb->Wait(round);
+            REQUIRE(std::chrono::steady_clock::now() - start < prompt);
+        }
+    }
+}
+
+// warmer notes the URLs it is asked to prewarm, and whether that came
+// before any request.
+class warmer : public segment::http::Handler {
+public:
+    warmer()
+        : requests(0)
+        , early(false)
+    {
+    }
+
+    std::unique_ptr<segment::http::Response> Handle(const segment::http::Request&)
+    {
+        std::lock_guard<std::mutex> l(lk);
+        requests++;
+        auto resp = std::unique_ptr<segment::http::Response>(new segment::http::Response());
+        resp->Code = 200;
+        return resp;
+    }
+
+    void Prewarm(const std::string& url)
+    {
+        std::lock_guard<std::mutex> l(lk);
+        urls.push_back(url);
+        early = (requests == 0);
+        cv.notify_all();
+    }
+
+    std::mutex lk;
+    std::condition_variable cv;
+    std::vector<std::string> urls;
+    int requests;
+    bool early;
+};
+
+TEST_CASE("Prewarm readies the handler in the background", "[batch]")
+{
+    auto handler = std::make_shared<warmer>();
+    {
+        Analytics analytics("writeKey", "http://localhost");
+        analytics.Handler = handler;
+        analytics.Prewarm();
+        {
+            std::unique_lock<std::mutex> l(handler->lk);
+            REQUIRE(handler->cv.wait_for(l, std::chrono::seconds(5), [&]() { return !handler->urls.empty(); }));
+        }
+        analytics.Track("user", "Warm");
+        analytics.FlushWait();
+    }
+    REQUIRE(handler->urls.size() == 1);
+    REQUIRE(handler->urls[0] == "http://localhost/v1/batch");
+    REQUIRE(handler->early);
+    REQUIRE(handler->requests == 1);
+}
+
+// picky refuses any batch holding a poisoned event with 400, and any
+// batch of more than most events with 413.  It notes who was delivered.
+class picky : public segment::http::Handler {
+public:
+    picky(size_t most)
+        : most(most)
+        , calls(0)
+    {
+    }
+
+    std::unique_ptr<segment::http::Response> Handle(const segment::http::Request& req)
+    {
+        std::lock_guard<std::mutex> l(lk);
+        calls++;
+        auto body = json::parse(req.Body);
+        auto resp = std::unique_ptr<segment::http::Response>(new segment::http::Response());
+        resp->Code = 200;
+        if (body["batch"].size() > most) {
+            resp->Code = 413;
+            return resp;
+        }
+        for (auto const& ev : body["batch"]) {
+            if (ev["userId"].get<std::string>().find("poison") == 0) {
+                resp->Code = 400;
+                return resp;
+            }
+        }
+        for (auto const& ev : body["batch"]) {
+            delivered.insert(ev["userId"].get<std::string>());
+        }
+        return resp;
+    }
+
+    std::mutex lk;
+    size_t most;
+    int calls;
+    std::set<std::string> delivered;
+};
+
+TEST_CASE("Refused batches are split to isolate bad events", "[batch]")
+{
+    auto cb = std::make_shared<counter>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Callback = cb;
+    analytics.AdaptiveRate = false;
+    analytics.FlushCount = 32;
+
+    SECTION("Poisoned events fail on their own")
+    {
+        auto handler = std::make_shared<picky>(100);
+        analytics.Handler = handler;
+        for (int i = 0; i < 32; i++) {
+            analytics.Track((i == 5 || i == 20 ? "poison" : "user") + std::to_string(i), "Split");
+        }
+        analytics.FlushWait();
+        REQUIRE(cb->success == 30);
+        REQUIRE(cb->fail == 2);
+        REQUIRE(cb->last_reason == "HTTP Error 400");
+        REQUIRE(handler->delivered.size() == 30);
+        REQUIRE(handler->delivered.count("user4") == 1);
+        REQUIRE(handler->delivered.count("user21") == 1);
+        auto m = analytics.GetMetrics();
+        REQUIRE(m.IsolatedEvents == 2);
+        REQUIRE(m.SplitBatches == 9);
+        REQUIRE(m.QueuedEvents == 0);
+    }
+
+    SECTION("Batches too large are split until they fit")
+    {
+        auto handler = std::make_shared<picky>(8);
+        analytics.Handler = handler;
+        for (int i = 0; i < 32; i++) {
+            analytics.Track("user" + std::to_string(i), "Split");
+        }
+        analytics.FlushWait();
+        REQUIRE(cb->success == 32);
+        REQUIRE(cb->fail == 0);
+        REQUIRE(analytics.GetMetrics().SplitBatches == 3);
+        REQUIRE(analytics.GetMetrics().IsolatedEvents == 0);
+    }
+
+    SECTION("Splitting stops at MaxSplitDepth")
+    {
+        auto handler = std::make_shared<picky>(100);
+        analytics.Handler = handler;
+        analytics.MaxSplitDepth = 1;
+        for (int i = 0; i < 32; i++) {
+            analytics.Track((i == 5 ? "poison" : "user") + std::to_string(i), "Split");
+        }
+        analytics.FlushWait();
+        REQUIRE(cb->success == 16);
+        REQUIRE(cb->fail == 16);
+        REQUIRE(handler->calls == 3);
+        REQUIRE(analytics.GetMetrics().IsolatedEvents == 16);
+    }
+}
+
+// throttler refuses the first requests with 429 Too Many Requests, and
+// notes when each request arrives.
+class throttler : public segment::http::Handler {
+public:
+    throttler(int refusals, std::string retryAfter)
+        : refusals(refusals)
+        , retryAfter(retryAfter)
+    {
+    }
+
+    std::unique_ptr<segment::http::Response> Handle(const segment::http::Request&)
+    {
+        std::lock_guard<std::mutex> l(lk);
+        times.push_back(std::chrono::steady_clock::now());
+        auto resp = std::unique_ptr<segment::http::Response>(new segment::http::Response());
+        resp->Code = 200;
+        if (refusals > 0) {
+            refusals--;
+            resp->Code = 429;
+            resp->Headers["retry-after"] = retryAfter;
+        }
+        return resp;
+    }
+
+    int refusals;
+    std::string retryAfter;
+    std::mutex lk;
+    std::vector<std::chrono::steady_clock::time_point> times;
+};
+
+TEST_CASE("Throttling is honored", "[batch]")
+{
+    auto cb = std::make_shared<counter>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Callback = cb;
+    analytics.FlushCount = 1;
+    analytics.Retry->BaseDelay = std::chrono::milliseconds(0);
+    REQUIRE(analytics.GetMetrics().SendRate == 0);
+
+    SECTION("Retry-After in seconds")
+    {
+        auto handler = std::make_shared<throttler>(1, "1");
+        analytics.Handler = handler;
+        analytics.Track("throttled", "Slow down");
+        analytics.FlushWait();
+        REQUIRE(cb->success == 1);
+        REQUIRE(handler->times.size() == 2);
+        REQUIRE(handler->times[1] - handler->times[0] >= std::chrono::milliseconds(900));
+    }
+
+    SECTION("Retry-After as a date")
+    {
+        auto when = std::chrono::system_clock::now() + std::chrono::seconds(2);
+        auto text = date::format("%a, %d %b %Y %H:%M:%S GMT", date::floor<std::chrono::seconds>(when));
+        auto handler = std::make_shared<throttler>(1, text);
+        analytics.Handler = handler;
+        analytics.Track("throttled", "Slow down");
+        analytics.FlushWait();
+        REQUIRE(cb->success == 1);
+        REQUIRE(handler->times[1] - handler->times[0] >= std::chrono::milliseconds(900));
+    }
+
+    // Far enough off to overflow the clock, were they taken at their word.
+    const char* absurd[] = { "99999999999", "Fri, 31 Dec 9999 23:59:59 GMT" };
+    for (auto retryAfter : absurd) {
+        SECTION(std::string("Retry-After is capped at MaxDelay: ") + retryAfter)
+        {
+            analytics.Retry->MaxDelay = std::chrono::milliseconds(300);
+            auto handler = std::make_shared<throttler>(2, retryAfter);
+            analytics.Handler = handler;
+            analytics.Track("throttled", "Slow down");
+            analytics.FlushWait();
+            REQUIRE(cb->success == 1);
+            REQUIRE(handler->times.size() == 3);
+            for (int i = 1; i < 3; i++) {
+                REQUIRE(handler->times[i] - handler->times[i - 1] >= std::chrono::milliseconds(250));
+                REQUIRE(handler->times[i] - handler->times[i - 1] < std::chrono::seconds(5));
+            }
+        }
+    }
+
+    SECTION("The send rate backs off")
+    {
+        auto handler = std::make_shared<throttler>(1, "0");
+        analytics.Handler = handler;
+        for (int i = 0; i < 3; i++) {
+            analytics.Track("throttled" + std::to_string(i), "Slow down");
+        }
+        analytics.FlushWait();
+        REQUIRE(cb->success == 3);
+        auto m = analytics.GetMetrics();
+        REQUIRE(m.Throttled == 1);
+        REQUIRE(m.SendRate > 0);
+        // Batches after the refusal are spaced out by the limit.
+        REQUIRE(handler->times.back() - handler->times[1] >= std::chrono::milliseconds(int(900 / m.SendRate)));
+    }
+}
+
+// gate holds every request until it is opened.
+class gate : public segment::http::Handler {
+public:
+    gate()
+        : stamps(0)
+        , open(false)
+    {
+    }
+
+    std::unique_ptr<segment::http::Response> Handle(const segment::http::Request& req)
+    {
+        std::unique_lock<std::mutex> l(lk);
+        while (!open) {
+            cv.wait(l);
+        }
+        auto body = json::parse(req.Body);
+        for (auto const& ev : body["batch"]) {
+            users.push_back(ev["userId"]);
+            sentAts.push_back(ev["sentAt"]);
+        }
+        // One for the batch; the rest belong to its events.
+        for (auto at = req.Body.find("\"sentAt\":"); at != std::string::npos; at = req.Body.find("\"sentAt\":", at + 1)) {
+            stamps++;
+        }
+        stamps--;
+        auto resp = std::unique_ptr<segment::http::Response>(new segment::http::Response());
+        resp->Code = 200;
+        return resp;
+    }
+
+    void Open()
+    {
+        std::lock_guard<std::mutex> l(lk);
+        open = true;
+        cv.notify_all();
+    }
+
+    // The users of the events sent, in the order they were sent, and
+    // the sentAt each carried.
+    std::vector<std::string> users;
+    std::vector<std::string> sentAts;
+    size_t stamps; // "sentAt": keys written for events
+
+private:
+    std::mutex lk;
+    std::condition_variable cv;
+    bool open;
+};
+
+TEST_CASE("Overflow policies bound the queue", "[batch]")
+{
+    auto handler = std::make_shared<gate>();
+    auto cb = std::make_shared<counter>();
+    Analytics analytics("writeKey", "http://localhost");
+    analytics.Handler = handler;
+    analytics.Callback = cb;
+    analytics.FlushCount = 1;
+    analytics.MaxQueuedEvents = 2;
+
+    SECTION("DropNewest drops new events")
+    {
+        analytics.Overflow = OverflowPolicy::DropNewest;
+        for (int i = 0; i < 5; i++) {
+            analytics.Track("newest" + std::to_string(i), "Overflow");
+        }
+        // Drops are reported before Track returns.
+        REQUIRE(cb->fail == 3);
+        REQUIRE(cb->last_reason == "Queue full");
+        REQUIRE(analytics.GetMetrics().DroppedNewest == 3);
+        REQUIRE(analytics.GetMetrics().QueuedEvents == 2);
+        handler->Open();
+        analytics.FlushWait();
+        REQUIRE(cb->success == 2);
+        REQUIRE(analytics.GetMetrics().QueuedEvents == 0);
+        REQUIRE(analytics.GetMetrics().QueuedBytes == 0);
+    }
+
+    SECTION("DropOldest keeps new events")
+    {
+        analytics.Overflow = OverflowPolicy::DropOldest;
+        for (int i = 0; i < 5; i++) {
+            analytics.Track("oldest" + std::to_string(i), "Overflow");
+        }
+        cb->Wait(3);
+        handler->Open();
+        analytics.FlushWait();
+        REQUIRE(cb->success == 2);
+        REQUIRE(cb->fail == 3);
+        REQUIRE(analytics.GetMetrics().DroppedOldest == 3);
+    }
+
+    SECTION("Block gives up after BlockTimeout")
+    {
+        analytics.Overflow = OverflowPolicy::Block;
+        analytics.BlockTimeout = std::chrono::milliseconds(100);
+        analytics.Track("block1", "Overflow");
+        analytics.Track("block2", "Overflow");
+        auto start = std::chrono::steady_clock::now();
+        analytics.Track("block3", "Overflow");
+        REQUIRE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(100));
+        REQUIRE(analytics.GetMetrics().DroppedTimeout == 1);
+
+        // With room made while we wait, nothing is dropped.
+        analytics.BlockTimeout = std::chrono::seconds(10);
+        std::thread opener([&]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            handler->Open();
+        });
+        analytics.Track("block4", "Overflow");
+        opener.join();
+        analytics.FlushWait();
+        REQUIRE(analytics.GetMetrics().DroppedTimeout == 1);
+        REQUIRE(cb->success == 3);
+    }
+
+    SECTION("Sample thins events as the queue fills")
+    {
+        analytics.Overflow = OverflowPolicy::Sample;
+        analytics.MaxQueuedEvents = 100;
+        for (int i = 0; i < 1000; i++) {
+            analytics.Track("sample" + std::to_string(i), "Overflow");
+        }
+        auto m = analytics.GetMetrics();
+        REQUIRE(m.QueuedEvents <= 100);
+        REQUIRE(m.QueuedEvents > 50);
+        REQUIRE(m.DroppedSampled == 1000 - m.QueuedEvents);
+        handler->Open();
+        analytics.FlushWait();
+    }
+}
+
+#ifndef _WIN32
+TEST_CASE("Events spill to disk and come back in order", "[batch]")
+{
+    char tmpl[] = "/tmp/analytics-spill-XXXXXX";
+    std::string dir = mkdtemp(tmpl);
+    size_t spilled;
+
+    {
+        auto handler = std::make_shared<gate>();
+        auto cb = std::make_shared<counter>();
+        Analytics analytics("writeKey", "http://localhost");
+        analytics.Handler = handler;
+        analytics.Callback = cb;
+        analytics.FlushCount = 10;
+        analytics.SpillThreshold = 20;
+        analytics.SpillSegmentSize = 4096; // force several segments
+        analytics.EnableSpill(dir);
+
+        for (int i = 0; i < 200; i++) {
+            if (i % 3 == 0) {
+                // One with a sentAt of its own, which must survive the spool.
+                auto ev = analytics.CreateTrackEvent("Spilled", "spill" + std::to_string(i));
+                ev["sentAt"] = "own";
+                analytics.PostEvent(std::move(ev));
+            } else {
+                analytics.Track("spill" + std::to_string(i), "Spilled");
+            }
+        }
+        while (analytics.GetMetrics().SpilledEvents < 150) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        handler->Open();
+        analytics.FlushWait();
+
+        REQUIRE(cb->success == 200);
+        REQUIRE(analytics.GetMetrics().SpilledEvents == 0);
+        REQUIRE(handler->users.size() == 200);
+        for (int i = 0; i < 200; i++) {
+            REQUIRE(handler->users[i] == "spill" + std::to_string(i));
+            REQUIRE((handler->sentAts[i] == "own") == (i % 3 == 0));
+        }
+        REQUIRE(handler->stamps == 200);
+    }
+
+    {
+        // Left behind at shutdown, and picked up on the next run.  The
+        // gate opens only once the destructor is under way, so that the
+        // spool cannot drain beforehand.
+        auto handler = std::make_shared<gate>();
+        std::thread opener;
+        {
+            Analytics analytics("writeKey", "http://localhost");
+            analytics.Handler = handler;
+            analytics.FlushCount = 10;
+            analytics.SpillThreshold = 20;
+            analytics.EnableSpill(dir);
+            for (int i = 0; i < 100; i++) {
+                analytics.Track("restart" + std::to_string(i), "Spilled");
+            }
+            while (analytics.GetMetrics().SpilledEvents < 50) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            analytics.Scrub();
+            opener = std::thread([handler]() {
+                std::this_thread::sleep_for(std::chrono::milliseconds(200));
+                handler->Open();
+            });
+        }
+        opener.join();
+    }
+
+    auto handler = std::make_shared<gate>();
+    handler->Open();
+    {
+        Analytics analytics("writeKey", "http://localhost");
+        analytics.Handler = handler;
+        analytics.EnableSpill(dir);
+        spilled = analytics.GetMetrics().SpilledEvents;
+        REQUIRE(spilled > 0);
+        analytics.FlushWait();
+        REQUIRE(analytics.GetMetrics().SpilledEvents == 0);
+    }
+    REQUIRE(handler->users.size() == spilled);
+    for (size_t i = 0; i < spilled; i++) {
+        REQUIRE(handler->users[i] == "restart" + std::to_string(100 - spilled + i));
+    }
+
+    // Every segment has been read, and removed.
+    REQUIRE(rmdir(dir.c_str()) == 0);
+}
+#endif